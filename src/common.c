@@ -2,15 +2,29 @@
  */
 
 #include "common.h"
+#include "hwmon.h"
+#include "netlink.h"
+#include "scheduler.h"
+#include "telemetry.h"
 
-#include <linux/hrtimer.h>
+#include <linux/debugfs.h>
+#include <linux/jiffies.h>
+#include <linux/mutex.h>
+#include <linux/seq_file.h>
+#include <linux/seqlock.h>
 #include <linux/slab.h>
+#include <linux/string.h>
 #include <linux/usb.h>
 #include <linux/workqueue.h>
 
 #define UPDATE_INTERVAL_DEFAULT (ms_to_ktime(1000))
 #define UPDATE_INTERVAL_MIN     (ms_to_ktime(500))
 
+#define UPDATE_INTERVAL_ADAPTIVE_MIN_DEFAULT (ms_to_ktime(500))
+#define UPDATE_INTERVAL_ADAPTIVE_MAX_DEFAULT (ms_to_ktime(5000))
+
+#define UPDATE_KICK_DELAY_MS 5
+
 static ssize_t update_interval_show(struct device *dev,
                                     struct device_attribute *attr, char *buf)
 {
@@ -31,38 +45,227 @@ update_interval_store(struct device *dev, struct device_attribute *attr,
 		return ret;
 	// interval is 0: halt updates
 	if (interval_ms == 0) {
-		hrtimer_cancel(&kraken->update_timer);
-		kraken->update_interval = ktime_set(0, 0);
+		kraken_scheduler_set_interval(kraken, ktime_set(0, 0));
 		dev_info(dev, "halting updates: interval set to 0\n");
 		return count;
 	}
-	// interval not 0: save interval in kraken
+	// interval not 0: save interval in kraken, which restarts updates if
+	// they'd been halted
 	interval_old = kraken->update_interval;
 	if (interval_ms < ktime_to_ms(UPDATE_INTERVAL_MIN))
-		kraken->update_interval = UPDATE_INTERVAL_MIN;
+		kraken_scheduler_set_interval(kraken, UPDATE_INTERVAL_MIN);
 	else
-		kraken->update_interval = ms_to_ktime(interval_ms);
-	// and restart updates if they'd been halted
+		kraken_scheduler_set_interval(kraken, ms_to_ktime(interval_ms));
 	if (ktime_compare(interval_old, ktime_set(0, 0)) == 0)
 		dev_info(dev, "restarting updates: interval set to non-0\n");
-		hrtimer_start(&kraken->update_timer, kraken->update_interval,
-		              HRTIMER_MODE_REL);
 	return count;
 }
 
 static DEVICE_ATTR_RW(update_interval);
 
+static ssize_t update_adaptive_show(struct device *dev,
+                                    struct device_attribute *attr, char *buf)
+{
+	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
+	return scnprintf(buf, PAGE_SIZE, "%d\n", kraken->update_adaptive);
+}
+
+static ssize_t
+update_adaptive_store(struct device *dev, struct device_attribute *attr,
+                      const char *buf, size_t count)
+{
+	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
+	bool adaptive;
+	int ret = kstrtobool(buf, &adaptive);
+	if (ret)
+		return ret;
+	kraken->update_adaptive = adaptive;
+	return count;
+}
+
+static DEVICE_ATTR_RW(update_adaptive);
+
+static int update_interval_bound_parse(const char *buf, ktime_t *interval)
+{
+	u64 interval_ms;
+	int ret = kstrtoull(buf, 0, &interval_ms);
+	if (ret)
+		return ret;
+	if (interval_ms < ktime_to_ms(UPDATE_INTERVAL_MIN))
+		*interval = UPDATE_INTERVAL_MIN;
+	else
+		*interval = ms_to_ktime(interval_ms);
+	return 0;
+}
+
+static ssize_t update_interval_min_show(struct device *dev,
+                                        struct device_attribute *attr,
+                                        char *buf)
+{
+	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
+	const s64 interval_ms = ktime_to_ms(kraken->update_interval_min);
+	return scnprintf(buf, PAGE_SIZE, "%lld\n", interval_ms);
+}
+
+static ssize_t
+update_interval_min_store(struct device *dev, struct device_attribute *attr,
+                          const char *buf, size_t count)
+{
+	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
+	ktime_t interval;
+	int ret = update_interval_bound_parse(buf, &interval);
+	if (ret)
+		return ret;
+	if (ktime_compare(interval, kraken->update_interval_max) > 0)
+		return -EINVAL;
+	kraken->update_interval_min = interval;
+	return count;
+}
+
+static DEVICE_ATTR_RW(update_interval_min);
+
+static ssize_t update_interval_max_show(struct device *dev,
+                                        struct device_attribute *attr,
+                                        char *buf)
+{
+	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
+	const s64 interval_ms = ktime_to_ms(kraken->update_interval_max);
+	return scnprintf(buf, PAGE_SIZE, "%lld\n", interval_ms);
+}
+
+static ssize_t
+update_interval_max_store(struct device *dev, struct device_attribute *attr,
+                          const char *buf, size_t count)
+{
+	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
+	ktime_t interval;
+	int ret = update_interval_bound_parse(buf, &interval);
+	if (ret)
+		return ret;
+	if (ktime_compare(interval, kraken->update_interval_min) < 0)
+		return -EINVAL;
+	kraken->update_interval_max = interval;
+	return count;
+}
+
+static DEVICE_ATTR_RW(update_interval_max);
+
+static ssize_t update_timer_show(struct device *dev,
+                                 struct device_attribute *attr, char *buf)
+{
+	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
+	return scnprintf(buf, PAGE_SIZE, "%s\n",
+	                 kraken->update_deferrable ? "deferrable" : "precise");
+}
+
+static ssize_t
+update_timer_store(struct device *dev, struct device_attribute *attr,
+                   const char *buf, size_t count)
+{
+	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
+	bool deferrable;
+	if (sysfs_streq(buf, "precise"))
+		deferrable = false;
+	else if (sysfs_streq(buf, "deferrable"))
+		deferrable = true;
+	else
+		return -EINVAL;
+	if (deferrable == kraken->update_deferrable)
+		return count;
+
+	kraken_scheduler_set_deferrable(kraken, deferrable);
+	return count;
+}
+
+static DEVICE_ATTR_RW(update_timer);
+
+static ssize_t update_slack_show(struct device *dev,
+                                 struct device_attribute *attr, char *buf)
+{
+	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
+	return scnprintf(buf, PAGE_SIZE, "%u\n", kraken->update_slack_ms);
+}
+
+static ssize_t
+update_slack_store(struct device *dev, struct device_attribute *attr,
+                   const char *buf, size_t count)
+{
+	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
+	unsigned int slack_ms;
+	int ret = kstrtouint(buf, 0, &slack_ms);
+	if (ret)
+		return ret;
+	// takes effect when the timers are reprogrammed after the next update
+	kraken->update_slack_ms = slack_ms;
+	return count;
+}
+
+static DEVICE_ATTR_RW(update_slack);
+
+static ssize_t update_error_show(struct device *dev,
+                                 struct device_attribute *attr, char *buf)
+{
+	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
+	return scnprintf(buf, PAGE_SIZE, "%d\n", kraken->update_error);
+}
+
+static DEVICE_ATTR_RO(update_error);
+
+static ssize_t update_retries_show(struct device *dev,
+                                   struct device_attribute *attr, char *buf)
+{
+	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
+	return scnprintf(buf, PAGE_SIZE, "%u\n", kraken->update_retries);
+}
+
+static DEVICE_ATTR_RO(update_retries);
+
 static int kraken_create_device_files(struct usb_interface *interface)
 {
 	int retval;
 	if ((retval = device_create_file(
 		     &interface->dev, &dev_attr_update_interval)))
 		goto error_update_interval;
+	if ((retval = device_create_file(
+		     &interface->dev, &dev_attr_update_adaptive)))
+		goto error_update_adaptive;
+	if ((retval = device_create_file(
+		     &interface->dev, &dev_attr_update_interval_min)))
+		goto error_update_interval_min;
+	if ((retval = device_create_file(
+		     &interface->dev, &dev_attr_update_interval_max)))
+		goto error_update_interval_max;
+	if ((retval = device_create_file(
+		     &interface->dev, &dev_attr_update_timer)))
+		goto error_update_timer;
+	if ((retval = device_create_file(
+		     &interface->dev, &dev_attr_update_slack)))
+		goto error_update_slack;
+	if ((retval = device_create_file(
+		     &interface->dev, &dev_attr_update_error)))
+		goto error_update_error;
+	if ((retval = device_create_file(
+		     &interface->dev, &dev_attr_update_retries)))
+		goto error_update_retries;
 	if ((retval = kraken_driver_create_device_files(interface)))
 		goto error_driver_files;
 
 	return 0;
 error_driver_files:
+	device_remove_file(&interface->dev, &dev_attr_update_retries);
+error_update_retries:
+	device_remove_file(&interface->dev, &dev_attr_update_error);
+error_update_error:
+	device_remove_file(&interface->dev, &dev_attr_update_slack);
+error_update_slack:
+	device_remove_file(&interface->dev, &dev_attr_update_timer);
+error_update_timer:
+	device_remove_file(&interface->dev, &dev_attr_update_interval_max);
+error_update_interval_max:
+	device_remove_file(&interface->dev, &dev_attr_update_interval_min);
+error_update_interval_min:
+	device_remove_file(&interface->dev, &dev_attr_update_adaptive);
+error_update_adaptive:
 	device_remove_file(&interface->dev, &dev_attr_update_interval);
 error_update_interval:
 	return retval;
@@ -72,44 +275,95 @@ static void kraken_remove_device_files(struct usb_interface *interface)
 {
 	kraken_driver_remove_device_files(interface);
 
+	device_remove_file(&interface->dev, &dev_attr_update_retries);
+	device_remove_file(&interface->dev, &dev_attr_update_error);
+	device_remove_file(&interface->dev, &dev_attr_update_slack);
+	device_remove_file(&interface->dev, &dev_attr_update_timer);
+	device_remove_file(&interface->dev, &dev_attr_update_interval_max);
+	device_remove_file(&interface->dev, &dev_attr_update_interval_min);
+	device_remove_file(&interface->dev, &dev_attr_update_adaptive);
 	device_remove_file(&interface->dev, &dev_attr_update_interval);
 }
 
-static enum hrtimer_restart kraken_update_timer(struct hrtimer *update_timer)
+void kraken_status_publish(struct usb_kraken *kraken,
+                           const struct kraken_status *status,
+                           const u8 *msg, size_t len)
 {
-	bool retval;
-	struct usb_kraken *kraken
-		= container_of(update_timer, struct usb_kraken, update_timer);
-
-	// last update failed: halt updates
-	if (kraken->update_retval) {
-		dev_err(&kraken->udev->dev,
-		        "halting updates: last update failed: %d\n",
-		        kraken->update_retval);
-		kraken->update_retval = 0;
-		kraken->update_interval = ktime_set(0, 0);
-		return HRTIMER_NORESTART;
-	}
+	unsigned long flags;
+	write_seqlock_irqsave(&kraken->status_lock, flags);
+	kraken->status = *status;
+	write_sequnlock_irqrestore(&kraken->status_lock, flags);
+	kraken_telemetry_push(kraken, status, msg, len);
+	kraken_netlink_status(kraken, status);
+}
 
-	// otherwise: queue new update and restart timer
-	retval = queue_work(kraken->update_workqueue, &kraken->update_work);
-	if (!retval)
-		dev_warn(&kraken->udev->dev, "work already on a queue\n");
-	hrtimer_forward(update_timer, ktime_get(), kraken->update_interval);
-	return HRTIMER_RESTART;
+void kraken_status_get(struct usb_kraken *kraken, struct kraken_status *status)
+{
+	unsigned int seq;
+	do {
+		seq = read_seqbegin(&kraken->status_lock);
+		*status = kraken->status;
+	} while (read_seqretry(&kraken->status_lock, seq));
+}
+
+void kraken_update_changed(struct usb_kraken *kraken)
+{
+	atomic_set(&kraken->update_changed, 1);
+}
+
+static void kraken_update(struct usb_kraken *kraken)
+{
+	int retval;
+	ktime_t start;
+	mutex_lock(&kraken->update_mutex);
+	start = ktime_get();
+	retval = kraken_driver_update(kraken);
+	kraken_histogram_add(&kraken->update_latency,
+	                     ktime_sub(ktime_get(), start));
+	mutex_unlock(&kraken->update_mutex);
+	atomic_inc(&kraken->update_ticks);
+	kraken_scheduler_report(kraken, retval);
 }
 
 static void kraken_update_work(struct work_struct *update_work)
 {
 	struct usb_kraken *kraken
 		= container_of(update_work, struct usb_kraken, update_work);
-	kraken->update_retval = kraken_driver_update(kraken);
+	kraken_update(kraken);
+}
+
+static void kraken_update_kick_work(struct work_struct *update_kick_work)
+{
+	struct usb_kraken *kraken = container_of(
+		to_delayed_work(update_kick_work), struct usb_kraken,
+		update_kick_work);
+	kraken_update(kraken);
+}
+
+void kraken_update_kick(struct usb_kraken *kraken)
+{
+	if (ktime_compare(kraken->update_interval, ktime_set(0, 0)) == 0)
+		return;
+	// NOTE: the kick is not pushed back if already queued, so that a steady
+	// stream of requests cannot postpone it indefinitely
+	kraken_scheduler_kick(kraken, msecs_to_jiffies(UPDATE_KICK_DELAY_MS));
+}
+
+static int kraken_debugfs_update_show(struct seq_file *seq, void *unused)
+{
+	struct usb_kraken *kraken = seq->private;
+	seq_printf(seq, "ticks %u\n", atomic_read(&kraken->update_ticks));
+	seq_printf(seq, "overruns %u\n", atomic_read(&kraken->update_overruns));
+	seq_puts(seq, "latency_us\n");
+	kraken_histogram_show(seq, &kraken->update_latency);
+	return 0;
 }
 
+DEFINE_SHOW_ATTRIBUTE(kraken_debugfs_update);
+
 int kraken_probe(struct usb_interface *interface,
                  const struct usb_device_id *id)
 {
-	char workqueue_name[64];
 	int retval = -ENOMEM;
 	struct usb_device *udev = interface_to_usbdev(interface);
 
@@ -117,36 +371,77 @@ int kraken_probe(struct usb_interface *interface,
 	if (kraken == NULL)
 		goto error_kraken;
 	kraken->udev = usb_get_dev(udev);
+	kraken->interface = interface;
 	usb_set_intfdata(interface, kraken);
 
+	seqlock_init(&kraken->status_lock);
+	memset(&kraken->status, 0, sizeof(kraken->status));
+	kraken->hwmon = NULL;
+	kraken->telemetry = NULL;
+	kraken->debugfs = NULL;
+
+	kraken->update_error = 0;
+	kraken->update_retries = 0;
+
+	kraken->update_interval = UPDATE_INTERVAL_DEFAULT;
+	kraken->update_adaptive = false;
+	kraken->update_interval_min = UPDATE_INTERVAL_ADAPTIVE_MIN_DEFAULT;
+	kraken->update_interval_max = UPDATE_INTERVAL_ADAPTIVE_MAX_DEFAULT;
+	atomic_set(&kraken->update_changed, 0);
+	kraken->update_slack_ms = 0;
+	kraken->update_deferrable = false;
+	INIT_WORK(&kraken->update_work, &kraken_update_work);
+	atomic_set(&kraken->update_ticks, 0);
+	atomic_set(&kraken->update_overruns, 0);
+	kraken_histogram_init(&kraken->update_latency);
+	INIT_DELAYED_WORK(&kraken->update_kick_work, &kraken_update_kick_work);
+	mutex_init(&kraken->update_mutex);
+
+	// the telemetry device must exist before the driver can publish a status
+	retval = kraken_telemetry_register(kraken);
+	if (retval) {
+		dev_err(&interface->dev,
+		        "failed to register telemetry device: %d\n", retval);
+		goto error_telemetry;
+	}
+	// debugfs is for diagnostics only, so failing to create it is not an
+	// error; created before the driver is probed so that it can add files
+	kraken->debugfs = debugfs_create_dir(dev_name(&interface->dev),
+	                                     kraken_scheduler_debugfs());
+	debugfs_create_file("update", 0444, kraken->debugfs, kraken,
+	                    &kraken_debugfs_update_fops);
 	retval = kraken_driver_probe(interface, id);
 	if (retval)
 		goto error_driver_probe;
+	// the device must be scheduled before the device files exist, since
+	// writing them may restart or kick updates
+	retval = kraken_scheduler_add(kraken);
+	if (retval)
+		goto error_scheduler;
 	retval = kraken_create_device_files(interface);
 	if (retval) {
 		dev_err(&interface->dev,
 		        "failed to create device files: %d\n", retval);
 		goto error_create_files;
 	}
-
-	kraken->update_retval = 0;
-
-	kraken->update_interval = UPDATE_INTERVAL_DEFAULT;
-	hrtimer_init(&kraken->update_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
-	kraken->update_timer.function = &kraken_update_timer;
-	hrtimer_start(&kraken->update_timer, kraken->update_interval,
-	              HRTIMER_MODE_REL);
-
-	snprintf(workqueue_name, sizeof(workqueue_name),
-	         "%s_up", kraken_driver_name);
-	kraken->update_workqueue
-		= create_singlethread_workqueue(workqueue_name);
-	INIT_WORK(&kraken->update_work, &kraken_update_work);
+	retval = kraken_hwmon_register(kraken);
+	if (retval) {
+		dev_err(&interface->dev,
+		        "failed to register hwmon device: %d\n", retval);
+		goto error_hwmon;
+	}
 
 	return 0;
+error_hwmon:
+	kraken_remove_device_files(interface);
 error_create_files:
+	kraken_scheduler_remove(kraken);
+error_scheduler:
 	kraken_driver_disconnect(interface);
 error_driver_probe:
+	debugfs_remove_recursive(kraken->debugfs);
+	kraken_telemetry_unregister(kraken);
+error_telemetry:
 	usb_set_intfdata(interface, NULL);
 	usb_put_dev(kraken->udev);
 	kfree(kraken);
@@ -158,14 +453,76 @@ void kraken_disconnect(struct usb_interface *interface)
 {
 	struct usb_kraken *kraken = usb_get_intfdata(interface);
 
-	flush_workqueue(kraken->update_workqueue);
-	destroy_workqueue(kraken->update_workqueue);
-	hrtimer_cancel(&kraken->update_timer);
-
+	// the files go first so that updates can't be restarted, then the
+	// scheduler's entry so that no new work is queued
+	kraken_hwmon_unregister(kraken);
 	kraken_remove_device_files(interface);
+	kraken_scheduler_remove(kraken);
+
 	kraken_driver_disconnect(interface);
+	debugfs_remove_recursive(kraken->debugfs);
+	// only once the driver can no longer publish a status
+	kraken_telemetry_unregister(kraken);
 
 	usb_set_intfdata(interface, NULL);
 	usb_put_dev(kraken->udev);
 	kfree(kraken);
 }
+
+int kraken_pre_reset(struct usb_interface *interface)
+{
+	int retval;
+	struct usb_kraken *kraken = usb_get_intfdata(interface);
+	// held until kraken_post_reset(), so that no update runs in between
+	mutex_lock(&kraken->update_mutex);
+	retval = kraken_driver_pre_reset(kraken);
+	if (retval)
+		mutex_unlock(&kraken->update_mutex);
+	return retval;
+}
+
+int kraken_post_reset(struct usb_interface *interface)
+{
+	struct usb_kraken *kraken = usb_get_intfdata(interface);
+	int retval = kraken_driver_post_reset(kraken);
+	mutex_unlock(&kraken->update_mutex);
+	if (retval) {
+		// the core then unbinds and probes the device again
+		dev_err(&interface->dev, "failed to restore device: %d\n",
+		        retval);
+		return retval;
+	}
+	// re-apply all settings right away rather than after the backoff
+	kraken_update_kick(kraken);
+	return 0;
+}
+
+int kraken_register(struct usb_driver *driver)
+{
+	int retval = kraken_scheduler_init();
+	if (retval)
+		goto error_scheduler;
+	retval = kraken_netlink_init();
+	if (retval)
+		goto error_netlink;
+	// NOTE: this file is linked into several modules, so the driver's name
+	// is used in place of KBUILD_MODNAME
+	retval = usb_register_driver(driver, THIS_MODULE, kraken_driver_name);
+	if (retval)
+		goto error_driver;
+	return 0;
+error_driver:
+	kraken_netlink_exit();
+error_netlink:
+	kraken_scheduler_exit();
+error_scheduler:
+	return retval;
+}
+
+void kraken_deregister(struct usb_driver *driver)
+{
+	// disconnects all devices first
+	usb_deregister(driver);
+	kraken_netlink_exit();
+	kraken_scheduler_exit();
+}
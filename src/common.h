@@ -5,11 +5,34 @@
 #ifndef LEVIATHAN_COMMON_H_INCLUDED
 #define LEVIATHAN_COMMON_H_INCLUDED
 
-#include <linux/hrtimer.h>
+#include "histogram.h"
+
+#include <linux/debugfs.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/seqlock.h>
 #include <linux/usb.h>
 #include <linux/workqueue.h>
 
 struct kraken_driver_data;
+struct kraken_telemetry;
+
+/**
+ * A sample of the readings that all devices report.
+ * @captured: when the status was received, by ktime_get(); ktime_set(0, 0) if
+ *            no status has been received yet
+ * @fan_percent, @pump_percent: the duty cycles applied when the status was
+ *                              received, 0 if unknown
+ */
+struct kraken_status {
+	ktime_t captured;
+	u8 temp_liquid;
+	u16 fan_rpm;
+	u16 pump_rpm;
+	u8 fan_percent;
+	u8 pump_percent;
+};
 
 /**
  * The custom data stored in the interface, retrievable by usb_get_intfdata().
@@ -20,12 +43,56 @@ struct usb_kraken {
 	struct usb_interface *interface;
 	struct kraken_driver_data *data;
 
-	int update_retval;
+	// the latest status, see kraken_status_publish()
+	seqlock_t status_lock;
+	struct kraken_status status;
+	// see hwmon.h
+	struct device *hwmon;
+	// see telemetry.h
+	struct kraken_telemetry *telemetry;
+	// the device's debugfs directory, named after its interface under the
+	// driver's; drivers may add their own files to it
+	struct dentry *debugfs;
+
+	// error of the last update if it failed, or 0
+	int update_error;
+	// number of consecutive failed updates; updates are retried with
+	// exponential backoff, and the device reset every
+	// SCHEDULER_RESET_RETRIES failures
+	unsigned int update_retries;
 	// a value of ktime_set(0, 0) indicates that updates are halted
 	ktime_t update_interval;
-	struct hrtimer update_timer;
-	struct workqueue_struct *update_workqueue;
+	// if true, update_interval is adapted after each update: it is reset to
+	// update_interval_min if the driver reported a change, and doubled up to
+	// update_interval_max otherwise
+	bool update_adaptive;
+	ktime_t update_interval_min;
+	ktime_t update_interval_max;
+	// non-0 if kraken_update_changed() was called since the last adaptation
+	atomic_t update_changed;
+	// how much later than update_interval an update may happen, so that the
+	// kernel can batch the timer with others
+	unsigned int update_slack_ms;
+
+	// if true, updates are timed by the scheduler's deferrable timer, which
+	// doesn't wake an idle CPU; otherwise by its precise one
+	bool update_deferrable;
+	// scheduling state, see scheduler.h
+	struct list_head update_node;
+	int update_slot;
+	ktime_t update_next;
+	// queued on the scheduler's workqueue when an update is due
 	struct work_struct update_work;
+	// updates run, and updates that came due while the previous one was
+	// still queued, since the device was connected
+	atomic_t update_ticks;
+	atomic_t update_overruns;
+	// durations of kraken_driver_update()
+	struct kraken_histogram update_latency;
+	// out-of-band update requested by kraken_update_kick()
+	struct delayed_work update_kick_work;
+	// serializes calls of kraken_driver_update()
+	struct mutex update_mutex;
 };
 
 /**
@@ -51,6 +118,28 @@ extern void kraken_driver_disconnect(struct usb_interface *interface);
  */
 extern int kraken_driver_update(struct usb_kraken *kraken);
 
+/**
+ * Driver-specific hooks called from kraken_pre_reset() and kraken_post_reset()
+ * with update_mutex held.  The first must stop all I/O to the device; the
+ * second must restore the device's state so that the next update re-applies
+ * all settings.
+ */
+extern int kraken_driver_pre_reset(struct usb_kraken *kraken);
+extern int kraken_driver_post_reset(struct usb_kraken *kraken);
+
+/**
+ * Driver-specific hwmon duty cycles, channel 0 being the fan and 1 the pump.
+ * attr is hwmon_pwm_input, a duty cycle of 0 – 255, or hwmon_pwm_enable, 1
+ * for a manual duty cycle and 2 for an automatic one.  The is_visible hook
+ * returns the attribute's file mode, or 0 if unsupported.  The write hook need
+ * not kick an update.
+ */
+extern umode_t kraken_driver_pwm_is_visible(u32 attr, int channel);
+extern int kraken_driver_pwm_read(struct usb_kraken *kraken, u32 attr,
+                                  int channel, long *val);
+extern int kraken_driver_pwm_write(struct usb_kraken *kraken, u32 attr,
+                                   int channel, long val);
+
 /**
  * Create driver-specific device attribute files.  Called from kraken_probe().
  */
@@ -62,8 +151,50 @@ extern int kraken_driver_create_device_files(struct usb_interface *interface);
  */
 extern void kraken_driver_remove_device_files(struct usb_interface *interface);
 
+/**
+ * Requests an update outside of the regular ones, e.g. so that a changed
+ * attribute takes effect immediately.  All requests made within
+ * UPDATE_KICK_DELAY_MS of the first one result in a single update.  Does
+ * nothing if updates are halted.
+ */
+void kraken_update_kick(struct usb_kraken *kraken);
+
+/**
+ * Reports that the device's readings changed noticeably, so that adaptive
+ * updates speed up.  Safe to call in interrupt context.
+ */
+void kraken_update_changed(struct usb_kraken *kraken);
+
+/**
+ * Registers the driver and sets up the update scheduler shared by its devices.
+ * Use module_kraken_driver() rather than calling this directly.
+ */
+int kraken_register(struct usb_driver *driver);
+void kraken_deregister(struct usb_driver *driver);
+
+#define module_kraken_driver(__usb_driver) \
+	module_driver(__usb_driver, kraken_register, kraken_deregister)
+
+/**
+ * Publishes the latest status of the device, together with the raw message it
+ * was decoded from, of which at most TELEMETRY_PAGE_RAW_SIZE bytes are kept.
+ * Called by the driver whenever it has received a valid status.  Safe to call
+ * in interrupt context.
+ */
+void kraken_status_publish(struct usb_kraken *kraken,
+                           const struct kraken_status *status,
+                           const u8 *msg, size_t len);
+
+/**
+ * Copies the latest status published.  Never blocks, and always copies a single
+ * sample.
+ */
+void kraken_status_get(struct usb_kraken *kraken, struct kraken_status *status);
+
 int kraken_probe(struct usb_interface *interface,
                  const struct usb_device_id *id);
 void kraken_disconnect(struct usb_interface *interface);
+int kraken_pre_reset(struct usb_interface *interface);
+int kraken_post_reset(struct usb_interface *interface);
 
 #endif  /* LEVIATHAN_COMMON_H_INCLUDED */
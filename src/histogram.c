@@ -0,0 +1,44 @@
+/* Implementation of the histograms.
+ */
+
+#include "histogram.h"
+
+#include <linux/atomic.h>
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/seq_file.h>
+
+void kraken_histogram_init(struct kraken_histogram *hist)
+{
+	size_t i;
+	for (i = 0; i < KRAKEN_HISTOGRAM_SIZE; i++)
+		atomic_set(&hist->buckets[i], 0);
+}
+
+void kraken_histogram_add(struct kraken_histogram *hist, ktime_t duration)
+{
+	const s64 us = ktime_to_us(duration);
+	size_t i = 0;
+	if (us > 0)
+		i = min_t(size_t, ilog2((u64) us) + 1,
+		          KRAKEN_HISTOGRAM_SIZE - 1);
+	atomic_inc(&hist->buckets[i]);
+}
+
+void kraken_histogram_show(struct seq_file *seq,
+                           struct kraken_histogram *hist)
+{
+	size_t i;
+	for (i = 0; i < KRAKEN_HISTOGRAM_SIZE; i++) {
+		const unsigned int count = atomic_read(&hist->buckets[i]);
+		const unsigned long long low = i ? 1ULL << (i - 1) : 0;
+		if (count == 0)
+			continue;
+		if (i == KRAKEN_HISTOGRAM_SIZE - 1)
+			seq_printf(seq, "  %10llu - %-10s %u\n", low, "", count);
+		else
+			seq_printf(seq, "  %10llu - %-10llu %u\n", low,
+			           1ULL << i, count);
+	}
+}
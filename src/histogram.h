@@ -0,0 +1,34 @@
+/* Log2 histograms of durations, for diagnostics in debugfs.
+ */
+
+#ifndef LEVIATHAN_HISTOGRAM_H_INCLUDED
+#define LEVIATHAN_HISTOGRAM_H_INCLUDED
+
+#include <linux/atomic.h>
+#include <linux/ktime.h>
+#include <linux/seq_file.h>
+
+/**
+ * Bucket 0 counts durations under 1 µs, bucket i > 0 those in
+ * [2^(i - 1), 2^i) µs, and the last bucket all longer ones too.
+ */
+#define KRAKEN_HISTOGRAM_SIZE 24
+
+struct kraken_histogram {
+	atomic_t buckets[KRAKEN_HISTOGRAM_SIZE];
+};
+
+void kraken_histogram_init(struct kraken_histogram *hist);
+
+/**
+ * Counts a duration.  Safe to call in interrupt context.
+ */
+void kraken_histogram_add(struct kraken_histogram *hist, ktime_t duration);
+
+/**
+ * Prints a line per non-empty bucket: its bounds in µs and its count.
+ */
+void kraken_histogram_show(struct seq_file *seq,
+                           struct kraken_histogram *hist);
+
+#endif  /* LEVIATHAN_HISTOGRAM_H_INCLUDED */
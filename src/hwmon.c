@@ -0,0 +1,130 @@
+/* Implementation of the hwmon device.
+ */
+
+#include "hwmon.h"
+#include "common.h"
+
+#include <linux/err.h>
+#include <linux/hwmon.h>
+#include <linux/kconfig.h>
+#include <linux/ktime.h>
+
+#if IS_REACHABLE(CONFIG_HWMON)
+
+static const char *const KRAKEN_HWMON_FAN_LABELS[] = {
+	"fan", "pump",
+};
+
+static umode_t kraken_hwmon_is_visible(const void *data,
+                                       enum hwmon_sensor_types type,
+                                       u32 attr, int channel)
+{
+	switch (type) {
+	case hwmon_temp:
+	case hwmon_fan:
+		return 0444;
+	case hwmon_pwm:
+		return kraken_driver_pwm_is_visible(attr, channel);
+	default:
+		return 0;
+	}
+}
+
+static int kraken_hwmon_read(struct device *dev, enum hwmon_sensor_types type,
+                             u32 attr, int channel, long *val)
+{
+	struct usb_kraken *kraken = dev_get_drvdata(dev);
+	struct kraken_status status;
+	switch (type) {
+	case hwmon_temp:
+		kraken_status_get(kraken, &status);
+		if (ktime_compare(status.captured, ktime_set(0, 0)) == 0)
+			return -ENODATA;
+		*val = status.temp_liquid * 1000;
+		return 0;
+	case hwmon_fan:
+		kraken_status_get(kraken, &status);
+		if (ktime_compare(status.captured, ktime_set(0, 0)) == 0)
+			return -ENODATA;
+		*val = channel == 0 ? status.fan_rpm : status.pump_rpm;
+		return 0;
+	case hwmon_pwm:
+		return kraken_driver_pwm_read(kraken, attr, channel, val);
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+static int kraken_hwmon_read_string(struct device *dev,
+                                    enum hwmon_sensor_types type, u32 attr,
+                                    int channel, const char **str)
+{
+	switch (type) {
+	case hwmon_temp:
+		*str = "liquid";
+		return 0;
+	case hwmon_fan:
+		*str = KRAKEN_HWMON_FAN_LABELS[channel];
+		return 0;
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+static int kraken_hwmon_write(struct device *dev, enum hwmon_sensor_types type,
+                              u32 attr, int channel, long val)
+{
+	struct usb_kraken *kraken = dev_get_drvdata(dev);
+	int ret;
+	if (type != hwmon_pwm)
+		return -EOPNOTSUPP;
+	ret = kraken_driver_pwm_write(kraken, attr, channel, val);
+	if (ret)
+		return ret;
+	kraken_update_kick(kraken);
+	return 0;
+}
+
+static const struct hwmon_channel_info *kraken_hwmon_info[] = {
+	HWMON_CHANNEL_INFO(temp, HWMON_T_INPUT | HWMON_T_LABEL),
+	HWMON_CHANNEL_INFO(fan,
+	                   HWMON_F_INPUT | HWMON_F_LABEL,
+	                   HWMON_F_INPUT | HWMON_F_LABEL),
+	HWMON_CHANNEL_INFO(pwm,
+	                   HWMON_PWM_INPUT | HWMON_PWM_ENABLE,
+	                   HWMON_PWM_INPUT | HWMON_PWM_ENABLE),
+	NULL,
+};
+
+static const struct hwmon_ops kraken_hwmon_ops = {
+	.is_visible  = kraken_hwmon_is_visible,
+	.read        = kraken_hwmon_read,
+	.read_string = kraken_hwmon_read_string,
+	.write       = kraken_hwmon_write,
+};
+
+static const struct hwmon_chip_info kraken_hwmon_chip_info = {
+	.ops  = &kraken_hwmon_ops,
+	.info = kraken_hwmon_info,
+};
+
+int kraken_hwmon_register(struct usb_kraken *kraken)
+{
+	// NOTE: not device-managed, since the hwmon device must be gone before
+	// kraken is freed in kraken_disconnect()
+	struct device *hwmon = hwmon_device_register_with_info(
+		&kraken->interface->dev, kraken_driver_name, kraken,
+		&kraken_hwmon_chip_info, NULL);
+	if (IS_ERR(hwmon))
+		return PTR_ERR(hwmon);
+	kraken->hwmon = hwmon;
+	return 0;
+}
+
+void kraken_hwmon_unregister(struct usb_kraken *kraken)
+{
+	hwmon_device_unregister(kraken->hwmon);
+	kraken->hwmon = NULL;
+}
+
+#endif  /* IS_REACHABLE(CONFIG_HWMON) */
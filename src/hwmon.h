@@ -0,0 +1,48 @@
+/* Registration of the devices with the hwmon subsystem.
+ */
+
+#ifndef LEVIATHAN_HWMON_H_INCLUDED
+#define LEVIATHAN_HWMON_H_INCLUDED
+
+#include "common.h"
+
+#include <linux/kconfig.h>
+#include <linux/kernel.h>
+
+/**
+ * Convert between hwmon duty cycles (0 – 255) and percents.
+ */
+static inline u8 kraken_pwm_to_percent(long pwm)
+{
+	return DIV_ROUND_CLOSEST(clamp(pwm, 0L, 255L) * 100, 255);
+}
+
+static inline long kraken_percent_to_pwm(u8 percent)
+{
+	return DIV_ROUND_CLOSEST(percent * 255, 100);
+}
+
+#if IS_REACHABLE(CONFIG_HWMON)
+
+/**
+ * Registers an hwmon device for the device's liquid temperature (temp1), fan
+ * and pump speeds (fan1 and fan2), and fan and pump duty cycles (pwm1 and
+ * pwm2).
+ */
+int kraken_hwmon_register(struct usb_kraken *kraken);
+void kraken_hwmon_unregister(struct usb_kraken *kraken);
+
+#else
+
+static inline int kraken_hwmon_register(struct usb_kraken *kraken)
+{
+	return 0;
+}
+
+static inline void kraken_hwmon_unregister(struct usb_kraken *kraken)
+{
+}
+
+#endif  /* IS_REACHABLE(CONFIG_HWMON) */
+
+#endif  /* LEVIATHAN_HWMON_H_INCLUDED */
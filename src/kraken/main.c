@@ -2,13 +2,22 @@
  */
 
 #include "../common.h"
+#include "../hwmon.h"
+#include "../netlink.h"
 
+#include <linux/hwmon.h>
 #include <linux/module.h>
 #include <linux/slab.h>
+#include <linux/sysfs.h>
 #include <linux/usb.h>
 
 #define DRIVER_NAME "kraken"
 
+#define TRANSFER_BUFFER_SIZE 32
+
+// speeds jitter slightly even when steady; smaller changes are not reported
+#define RPM_CHANGE_MIN 50
+
 struct kraken_driver_data {
 	// TODO: it would be nice to protect these messages from data races by
 	// mutexes, like in kraken_x62.  They shouldn't happen frequently, and
@@ -18,7 +27,17 @@ struct kraken_driver_data {
 	u8 color_message[19];
 	u8 pump_message[2];
 	u8 fan_message[2];
+	// only accessed by kraken_driver_update(); readers use the status
+	// published from it
 	u8 status_message[32];
+	// messages are sent and received through this buffer, so that only it
+	// has to be DMA capable, and DMA never shares a cache line with the rest
+	// of the data
+	u8 *transfer_buffer;
+	// readings as of the last status that changed them noticeably
+	u8 temp_ref;
+	u16 pump_ref;
+	u16 fan_ref;
 };
 
 static int kraken_start_transaction(struct usb_kraken *kraken)
@@ -29,7 +48,10 @@ static int kraken_start_transaction(struct usb_kraken *kraken)
 static int kraken_send_message(struct usb_kraken *kraken, u8 *message, int length)
 {
 	int sent;
-	int retval = usb_bulk_msg(kraken->udev, usb_sndbulkpipe(kraken->udev, 2), message, length, &sent, 3000);
+	int retval;
+	u8 *buffer = kraken->data->transfer_buffer;
+	memcpy(buffer, message, length);
+	retval = usb_bulk_msg(kraken->udev, usb_sndbulkpipe(kraken->udev, 2), buffer, length, &sent, 3000);
 	if (retval != 0)
 		return retval;
 	if (sent != length)
@@ -40,14 +62,67 @@ static int kraken_send_message(struct usb_kraken *kraken, u8 *message, int lengt
 static int kraken_receive_message(struct usb_kraken *kraken, u8 message[], int expected_length)
 {
 	int received;
-	int retval = usb_bulk_msg(kraken->udev, usb_rcvbulkpipe(kraken->udev, 2), message, expected_length, &received, 3000);
+	u8 *buffer = kraken->data->transfer_buffer;
+	int retval = usb_bulk_msg(kraken->udev, usb_rcvbulkpipe(kraken->udev, 2), buffer, expected_length, &received, 3000);
 	if (retval != 0)
 		return retval;
 	if (received != expected_length)
 		return -EIO;
+	memcpy(message, buffer, expected_length);
 	return 0;
 }
 
+static bool kraken_rpm_changed(u16 *ref, u16 rpm)
+{
+	if (abs((int) rpm - (int) *ref) < RPM_CHANGE_MIN)
+		return false;
+	*ref = rpm;
+	return true;
+}
+
+static void kraken_status_publish_message(struct usb_kraken *kraken)
+{
+	struct kraken_driver_data *data = kraken->data;
+	struct kobject *kobj = &kraken->interface->dev.kobj;
+	struct kraken_status old;
+	struct kraken_status status;
+	status.captured = ktime_get();
+	status.temp_liquid = data->status_message[10];
+	status.fan_rpm = 256 * data->status_message[0] + data->status_message[1];
+	status.pump_rpm = 256 * data->status_message[8] + data->status_message[9];
+	status.fan_percent = data->fan_message[1];
+	status.pump_percent = data->pump_message[1];
+	kraken_status_get(kraken, &old);
+	kraken_status_publish(kraken, &status, data->status_message,
+	                      sizeof(data->status_message));
+
+	// wake up pollers of the attributes whose value changed
+	if (status.temp_liquid != old.temp_liquid)
+		sysfs_notify(kobj, NULL, "temp");
+	if (status.pump_rpm != old.pump_rpm)
+		sysfs_notify(kobj, NULL, "pump");
+	if (status.fan_rpm != old.fan_rpm)
+		sysfs_notify(kobj, NULL, "fan");
+	if (status.fan_percent != old.fan_percent)
+		kraken_netlink_duty(kraken, "fan", status.fan_percent);
+	if (status.pump_percent != old.pump_percent)
+		kraken_netlink_duty(kraken, "pump", status.pump_percent);
+}
+
+static void kraken_status_check_changed(struct usb_kraken *kraken)
+{
+	struct kraken_driver_data *data = kraken->data;
+	bool changed = false;
+	if (data->status_message[10] != data->temp_ref) {
+		data->temp_ref = data->status_message[10];
+		changed = true;
+	}
+	changed |= kraken_rpm_changed(&data->pump_ref, 256 * data->status_message[8] + data->status_message[9]);
+	changed |= kraken_rpm_changed(&data->fan_ref, 256 * data->status_message[0] + data->status_message[1]);
+	if (changed)
+		kraken_update_changed(kraken);
+}
+
 int kraken_driver_update(struct usb_kraken *kraken)
 {
 	int retval = 0;
@@ -69,6 +144,10 @@ int kraken_driver_update(struct usb_kraken *kraken)
 		   )
 			dev_err(&kraken->udev->dev, "Failed to update: %d\n", retval);
 	}
+	if (!retval) {
+		kraken_status_publish_message(kraken);
+		kraken_status_check_changed(kraken);
+	}
 	return retval;
 }
 
@@ -91,6 +170,7 @@ static ssize_t set_speed(struct device *dev, struct device_attribute *attr, cons
 
 	data->pump_message[1] = speed;
 	data->fan_message[1] = speed;
+	kraken_update_kick(kraken);
 
 	return count;
 }
@@ -119,6 +199,7 @@ static ssize_t set_color(struct device *dev, struct device_attribute *attr, cons
 	data->color_message[3] = b;
 
 	data->send_color = true;
+	kraken_update_kick(kraken);
 
 	return count;
 }
@@ -147,6 +228,7 @@ static ssize_t set_alternate_color(struct device *dev, struct device_attribute *
 	data->color_message[6] = b;
 
 	data->send_color = true;
+	kraken_update_kick(kraken);
 
 	return count;
 }
@@ -173,6 +255,7 @@ static ssize_t set_interval(struct device *dev, struct device_attribute *attr, c
 	data->color_message[11] = interval; data->color_message[12] = interval;
 
 	data->send_color = true;
+	kraken_update_kick(kraken);
 
 	return count;
 }
@@ -219,6 +302,7 @@ static ssize_t set_mode(struct device *dev, struct device_attribute *attr, const
 		return -EINVAL;
 
 	data->send_color = true;
+	kraken_update_kick(kraken);
 
 	return count;
 }
@@ -228,9 +312,10 @@ static DEVICE_ATTR(mode, S_IRUGO | S_IWUSR | S_IWGRP, show_mode, set_mode);
 static ssize_t show_temp(struct device *dev, struct device_attribute *attr, char *buf)
 {
 	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
-	struct kraken_driver_data *data = kraken->data;
+	struct kraken_status status;
 
-	return scnprintf(buf, PAGE_SIZE, "%u\n", data->status_message[10]);
+	kraken_status_get(kraken, &status);
+	return scnprintf(buf, PAGE_SIZE, "%u\n", status.temp_liquid);
 }
 
 static DEVICE_ATTR(temp, S_IRUGO, show_temp, NULL);
@@ -238,9 +323,10 @@ static DEVICE_ATTR(temp, S_IRUGO, show_temp, NULL);
 static ssize_t show_pump(struct device *dev, struct device_attribute *attr, char *buf)
 {
 	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
-	struct kraken_driver_data *data = kraken->data;
+	struct kraken_status status;
 
-	return scnprintf(buf, PAGE_SIZE, "%u\n", 256 * data->status_message[8] + data->status_message[9]);
+	kraken_status_get(kraken, &status);
+	return scnprintf(buf, PAGE_SIZE, "%u\n", status.pump_rpm);
 }
 
 static DEVICE_ATTR(pump, S_IRUGO, show_pump, NULL);
@@ -248,13 +334,43 @@ static DEVICE_ATTR(pump, S_IRUGO, show_pump, NULL);
 static ssize_t show_fan(struct device *dev, struct device_attribute *attr, char *buf)
 {
 	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
-	struct kraken_driver_data *data = kraken->data;
+	struct kraken_status status;
 
-	return scnprintf(buf, PAGE_SIZE, "%u\n", 256 * data->status_message[0] + data->status_message[1]);
+	kraken_status_get(kraken, &status);
+	return scnprintf(buf, PAGE_SIZE, "%u\n", status.fan_rpm);
 }
 
 static DEVICE_ATTR(fan, S_IRUGO, show_fan, NULL);
 
+umode_t kraken_driver_pwm_is_visible(u32 attr, int channel)
+{
+	// speeds are always set manually
+	if (attr == hwmon_pwm_input)
+		return 0644;
+	return 0;
+}
+
+int kraken_driver_pwm_read(struct usb_kraken *kraken, u32 attr, int channel, long *val)
+{
+	struct kraken_driver_data *data = kraken->data;
+	*val = kraken_percent_to_pwm(channel == 0 ? data->fan_message[1] : data->pump_message[1]);
+	return 0;
+}
+
+int kraken_driver_pwm_write(struct usb_kraken *kraken, u32 attr, int channel, long val)
+{
+	struct kraken_driver_data *data = kraken->data;
+	u8 speed;
+	if (val < 0 || val > 255)
+		return -EINVAL;
+	speed = clamp(kraken_pwm_to_percent(val), (u8) 30, (u8) 100);
+	if (channel == 0)
+		data->fan_message[1] = speed;
+	else
+		data->pump_message[1] = speed;
+	return 0;
+}
+
 int kraken_driver_create_device_files(struct usb_interface *interface)
 {
 	int retval;
@@ -311,10 +427,13 @@ int kraken_driver_probe(struct usb_interface *interface, const struct usb_device
 	struct kraken_driver_data *data;
 	struct usb_kraken *kraken = usb_get_intfdata(interface);
 	int retval = -ENOMEM;
-	kraken->data = kmalloc(sizeof(*kraken->data), GFP_KERNEL | GFP_DMA);
+	kraken->data = kzalloc(sizeof(*kraken->data), GFP_KERNEL);
 	if (!kraken->data)
 		goto error_data;
 	data = kraken->data;
+	data->transfer_buffer = kmalloc(TRANSFER_BUFFER_SIZE, GFP_KERNEL);
+	if (!data->transfer_buffer)
+		goto error_transfer_buffer;
 
 	data->color_message[0] = 0x10;
 	data->color_message[1] = 0x00; data->color_message[2] = 0x00; data->color_message[3] = 0xff;
@@ -339,16 +458,34 @@ int kraken_driver_probe(struct usb_interface *interface, const struct usb_device
 
 	return 0;
 error:
+	kfree(data->transfer_buffer);
+error_transfer_buffer:
 	kfree(data);
 error_data:
 	return retval;
 }
 
+int kraken_driver_pre_reset(struct usb_kraken *kraken)
+{
+	// updates are synchronous, so no I/O is left once update_mutex is held
+	return 0;
+}
+
+int kraken_driver_post_reset(struct usb_kraken *kraken)
+{
+	int retval = usb_control_msg(kraken->udev, usb_sndctrlpipe(kraken->udev, 0), 2, 0x40, 0x0002, 0, NULL, 0, 1000);
+	if (retval)
+		return retval;
+	kraken->data->send_color = true;
+	return 0;
+}
+
 void kraken_driver_disconnect(struct usb_interface *interface)
 {
 	struct usb_kraken *kraken = usb_get_intfdata(interface);
 	struct kraken_driver_data *data = kraken->data;
 
+	kfree(data->transfer_buffer);
 	kfree(data);
 
 	dev_info(&interface->dev, "Kraken disconnected\n");
@@ -365,11 +502,13 @@ static struct usb_driver kraken_x61_driver = {
 	.name       = DRIVER_NAME,
 	.probe      = kraken_probe,
 	.disconnect = kraken_disconnect,
+	.pre_reset  = kraken_pre_reset,
+	.post_reset = kraken_post_reset,
 	.id_table   = kraken_x61_id_table,
 };
 
 const char *kraken_driver_name = DRIVER_NAME;
 
-module_usb_driver(kraken_x61_driver);
+module_kraken_driver(kraken_x61_driver);
 
 MODULE_LICENSE("GPL");
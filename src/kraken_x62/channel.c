@@ -0,0 +1,48 @@
+/* Per-channel failure accounting.
+ */
+
+#include "channel.h"
+
+#include <linux/atomic.h>
+
+static const char *const CHANNEL_NAMES[CHANNELS_SIZE] = {
+	[CHANNEL_STATUS] = "status",
+	[CHANNEL_FAN]    = "fan",
+	[CHANNEL_PUMP]   = "pump",
+	[CHANNEL_LOGO]   = "logo",
+	[CHANNEL_RING]   = "ring",
+	[CHANNEL_SYNC]   = "sync",
+};
+
+void channel_data_init(struct channel_data *data)
+{
+	atomic_set(&data->error, 0);
+	atomic_set(&data->failures, 0);
+}
+
+const char *channel_name(enum channel channel)
+{
+	return CHANNEL_NAMES[channel];
+}
+
+void channel_data_fail(struct channel_data *data, int error)
+{
+	if (error)
+		atomic_cmpxchg(&data->error, 0, error);
+}
+
+int channel_data_collect(struct channel_data *data)
+{
+	return atomic_xchg(&data->error, 0);
+}
+
+void channel_data_account(struct channel_data *data, int error)
+{
+	if (error)
+		atomic_inc(&data->failures);
+}
+
+unsigned int channel_data_failures(struct channel_data *data)
+{
+	return atomic_read(&data->failures);
+}
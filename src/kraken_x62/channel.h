@@ -0,0 +1,65 @@
+#ifndef LEVIATHAN_X62_CHANNEL_H_INCLUDED
+#define LEVIATHAN_X62_CHANNEL_H_INCLUDED
+
+#include <linux/atomic.h>
+#include <linux/types.h>
+
+/**
+ * The independently updated parts of the device.  The cooling channels come
+ * first, and are updated before the cosmetic ones.
+ */
+enum channel {
+	CHANNEL_STATUS,
+	CHANNEL_FAN,
+	CHANNEL_PUMP,
+	CHANNEL_LOGO,
+	CHANNEL_RING,
+	CHANNEL_SYNC,
+
+	CHANNELS_SIZE,
+};
+
+/**
+ * The last channel needed for cooling.  Only failures of cooling channels fail
+ * an update, so that a misbehaving cosmetic channel cannot delay them.
+ */
+#define CHANNEL_COOLING_LAST CHANNEL_PUMP
+
+/**
+ * Failure accounting of a channel.
+ */
+struct channel_data {
+	// first error since the last collection by channel_data_collect(), or 0
+	atomic_t error;
+	// number of failures accounted for by channel_data_account()
+	atomic_t failures;
+};
+
+void channel_data_init(struct channel_data *data);
+
+const char *channel_name(enum channel channel);
+
+static inline bool channel_cooling(enum channel channel)
+{
+	return channel <= CHANNEL_COOLING_LAST;
+}
+
+/**
+ * Records an error to be returned by the next channel_data_collect().  Does
+ * nothing if error is 0.  Safe to call in interrupt context.
+ */
+void channel_data_fail(struct channel_data *data, int error);
+
+/**
+ * Returns and clears the recorded error, if any.
+ */
+int channel_data_collect(struct channel_data *data);
+
+/**
+ * Counts error as a failure of the channel, unless it is 0.
+ */
+void channel_data_account(struct channel_data *data, int error);
+
+unsigned int channel_data_failures(struct channel_data *data);
+
+#endif  /* LEVIATHAN_X62_CHANNEL_H_INCLUDED */
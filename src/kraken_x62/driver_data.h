@@ -1,16 +1,33 @@
 #ifndef LEVIATHAN_X62_DRIVER_DATA_H_INCLUDED
 #define LEVIATHAN_X62_DRIVER_DATA_H_INCLUDED
 
+#include "channel.h"
+#include "dynamic.h"
 #include "led.h"
 #include "percent.h"
 #include "status.h"
+#include "transfer.h"
+
+#include <linux/debugfs.h>
+#include <linux/workqueue.h>
 
 #define DATA_SERIAL_NUMBER_SIZE ((size_t) 65)
 
 struct kraken_driver_data {
+	struct usb_kraken *kraken;
 	char serial_number[DATA_SERIAL_NUMBER_SIZE];
 
+	struct transfer_data transfers;
+	// sends the percent and LED updates once a status message has arrived
+	struct work_struct send_work;
+	struct channel_data channels[CHANNELS_SIZE];
+	// counters of each channel's transfers, shown in debugfs
+	struct transfer_stats transfer_stats[CHANNELS_SIZE];
+	struct dentry *debugfs;
+
 	struct status_data status;
+	// fed through the external_value attribute
+	struct dynamic_val_external external;
 
 	struct percent_data percent_fan;
 	struct percent_data percent_pump;
@@ -6,6 +6,15 @@
 #include "status.h"
 #include "../util.h"
 
+#include <linux/device.h>
+#include <linux/err.h>
+#include <linux/jiffies.h>
+#include <linux/kernel.h>
+#include <linux/math64.h>
+#include <linux/seqlock.h>
+#include <linux/string.h>
+#include <linux/thermal.h>
+
 s8 dynamic_val_const_0(void *state, struct kraken_driver_data *driver_data)
 {
 	return 0;
@@ -39,19 +48,201 @@ static s8 dynamic_val_pump_rpm(void *state,
 	return dynamic_val_normalized(rpm, state);
 }
 
-static int dynamic_val_parse_normalized(struct dynamic_val *value,
+/**
+ * Dynamic values must be negative iff an error occurs, so errnos beyond s8 are
+ * reported as -EIO.
+ */
+static s8 dynamic_val_errno(int ret)
+{
+	return ret >= S8_MIN ? ret : -EIO;
+}
+
+static s8 dynamic_val_celsius(long millidegrees)
+{
+	return clamp_t(long, DIV_ROUND_CLOSEST(millidegrees, 1000), 0,
+	               DYNAMIC_VAL_MAX);
+}
+
+/**
+ * Like str_scan_word(), but also ends words at the parentheses and commas of
+ * composite values, which are words of their own.
+ */
+static int dynamic_val_scan(const char **buf, char *word)
+{
+	const char *start = skip_spaces(*buf);
+	size_t len;
+	if (*start != '\0' && strchr("(),", *start) != NULL)
+		len = 1;
+	else
+		len = strcspn(start, "(), \t\n\v\f\r");
+	if (len == 0 || len > WORD_LEN_MAX)
+		return 1;
+	memcpy(word, start, len);
+	word[len] = '\0';
+	*buf = start + len;
+	return 0;
+}
+
+struct dynamic_val_thermal_zone {
+	char type[THERMAL_NAME_LENGTH];
+	// the thermal class, which lives as long as the thermal core
+	struct class *class;
+};
+
+static int dynamic_val_thermal_zone_match(struct device *dev, const void *type)
+{
+	// the class also holds the cooling devices
+	if (strncmp(dev_name(dev), "thermal_zone", strlen("thermal_zone")) != 0)
+		return 0;
+	return strcmp(container_of(dev, struct thermal_zone_device,
+	                           device)->type, type) == 0;
+}
+
+static s8 dynamic_val_thermal_zone(void *state,
+                                   struct kraken_driver_data *driver_data)
+{
+	struct dynamic_val_thermal_zone *zone = state;
+	struct thermal_zone_device *tz;
+	struct device *tz_dev;
+	int temp;
+	int ret = -ENODEV;
+	// thermal_zone_get_zone_by_name() takes no reference, so the zone is
+	// looked up through its class instead, which returns it with one; the
+	// reference keeps the zone from being freed while it is read, and is
+	// never kept past the read
+	tz_dev = class_find_device(zone->class, NULL, zone->type,
+	                           dynamic_val_thermal_zone_match);
+	if (tz_dev == NULL)
+		return -ENODEV;
+	tz = container_of(tz_dev, struct thermal_zone_device, device);
+	if (device_is_registered(tz_dev))
+		ret = thermal_zone_get_temp(tz, &temp);
+	put_device(tz_dev);
+	if (ret)
+		return dynamic_val_errno(ret);
+	return dynamic_val_celsius(temp);
+}
+
+static int dynamic_val_parse_thermal_zone(struct dynamic_val_node *node,
+                                          const char **buf,
+                                          struct device *dev, const char *attr)
+{
+	struct dynamic_val_thermal_zone *zone
+		= (struct dynamic_val_thermal_zone *) node->state;
+	struct thermal_zone_device *tz;
+	char type[WORD_LEN_MAX + 1];
+	int ret = dynamic_val_scan(buf, type);
+	BUILD_BUG_ON(sizeof(*zone) > DYNAMIC_VAL_STATE_SIZE);
+	if (ret) {
+		dev_warn(dev, "%s: missing thermal zone type\n", attr);
+		return ret;
+	}
+	if (strlen(type) >= sizeof(zone->type)) {
+		dev_warn(dev, "%s: thermal zone type %s too long\n", attr, type);
+		return -EINVAL;
+	}
+	// fails with -EEXIST if several zones are of the type
+	tz = thermal_zone_get_zone_by_name(type);
+	if (IS_ERR(tz)) {
+		dev_warn(dev, "%s: no single thermal zone of type %s: %ld\n",
+		         attr, type, PTR_ERR(tz));
+		return PTR_ERR(tz);
+	}
+	strcpy(zone->type, type);
+	zone->class = tz->device.class;
+	return 0;
+}
+
+void dynamic_val_external_init(struct dynamic_val_external *external)
+{
+	seqlock_init(&external->lock);
+	external->value = 0;
+	external->updated = 0;
+	external->written = false;
+}
+
+void dynamic_val_external_set(struct dynamic_val_external *external, s8 value)
+{
+	write_seqlock(&external->lock);
+	external->value = value;
+	external->updated = jiffies;
+	external->written = true;
+	write_sequnlock(&external->lock);
+}
+
+/**
+ * Reads the value and its age in jiffies as one.
+ */
+static s8 dynamic_val_external_read(struct dynamic_val_external *external,
+                                    unsigned long *age)
+{
+	unsigned int seq;
+	s8 value;
+	do {
+		seq = read_seqbegin(&external->lock);
+		value = external->written ? external->value : -ENODATA;
+		*age = jiffies - external->updated;
+	} while (read_seqretry(&external->lock, seq));
+	return value;
+}
+
+s8 dynamic_val_external_get(struct dynamic_val_external *external)
+{
+	unsigned long age;
+	return dynamic_val_external_read(external, &age);
+}
+
+static s8 dynamic_val_external(void *state,
+                               struct kraken_driver_data *driver_data)
+{
+	const unsigned int *timeout_ms = state;
+	unsigned long age;
+	const s8 value = dynamic_val_external_read(&driver_data->external,
+	                                           &age);
+	// fall back to the liquid temperature if the feeder never wrote or went
+	// quiet, so that the fans keep responding to heat
+	if (value < 0 ||
+	    (*timeout_ms != 0 && age > msecs_to_jiffies(*timeout_ms)))
+		return dynamic_val_temp_liquid(state, driver_data);
+	return value;
+}
+
+static int dynamic_val_parse_external(struct dynamic_val_node *node,
+                                      const char **buf,
+                                      struct device *dev, const char *attr)
+{
+	unsigned int *timeout_ms = (unsigned int *) node->state;
+	char timeout_str[WORD_LEN_MAX + 1];
+	int ret = dynamic_val_scan(buf, timeout_str);
+	if (ret) {
+		dev_warn(dev, "%s: missing external value timeout\n", attr);
+		return ret;
+	}
+	ret = kstrtouint(timeout_str, 0, timeout_ms);
+	if (ret) {
+		dev_warn(dev, "%s: invalid external value timeout %s\n", attr,
+		         timeout_str);
+		return ret;
+	}
+	return 0;
+}
+
+static int dynamic_val_parse_normalized(struct dynamic_val_node *node,
                                         const char **buf,
                                         struct device *dev, const char *attr)
 {
-	s64 *max = (s64 *) value->state;
+	s64 *max = (s64 *) node->state;
 	unsigned long long max_ull;
 	char max_str[WORD_LEN_MAX + 1];
-	int ret = str_scan_word(buf, max_str);
+	int ret = dynamic_val_scan(buf, max_str);
 	if (ret) {
 		dev_warn(dev, "%s: missing dynamic value max\n", attr);
 		return ret;
 	}
 	ret = kstrtoull(max_str, 0, &max_ull);
+	// the max is divided by
+	if (!ret && (max_ull == 0 || max_ull > S64_MAX))
+		ret = -EINVAL;
 	if (ret) {
 		dev_warn(dev, "%s: invalid dynamic value max %s\n", attr,
 		         max_str);
@@ -61,24 +252,154 @@ static int dynamic_val_parse_normalized(struct dynamic_val *value,
 	return 0;
 }
 
-int dynamic_val_parse(struct dynamic_val *value, const char **buf,
-                      struct device *dev, const char *attr)
+void dynamic_val_init(struct dynamic_val *value,
+                      s8 (*get)(void *state,
+                                struct kraken_driver_data *driver_data))
 {
+	value->len = 1;
+	value->nodes[0].get = get;
+	value->nodes[0].op = DYNAMIC_VAL_OP_MAX;
+	value->nodes[0].operands = 0;
+	value->nodes[0].weight = 1000;
+}
+
+/**
+ * Evaluates the subtree at *i, leaving *i after it.
+ */
+static s8 dynamic_val_eval(struct dynamic_val *value, size_t *i,
+                           struct kraken_driver_data *driver_data)
+{
+	struct dynamic_val_node *node = &value->nodes[(*i)++];
+	s64 sum = 0;
+	s8 result;
+	u8 operand;
+	// op is only meaningful for operators
+	if (node->get != NULL)
+		return node->get(node->state, driver_data);
+
+	result = node->op == DYNAMIC_VAL_OP_MIN ? DYNAMIC_VAL_MAX : 0;
+
+	for (operand = 0; operand < node->operands; operand++) {
+		const s32 weight = value->nodes[*i].weight;
+		const s8 val = dynamic_val_eval(value, i, driver_data);
+		if (val < 0)
+			return val;
+		switch (node->op) {
+		case DYNAMIC_VAL_OP_MAX:
+			result = max(result, val);
+			break;
+		case DYNAMIC_VAL_OP_MIN:
+			result = min(result, val);
+			break;
+		case DYNAMIC_VAL_OP_SUM:
+			sum += (s64) weight * val;
+			break;
+		}
+	}
+	if (node->op == DYNAMIC_VAL_OP_SUM)
+		result = clamp_t(s64, div_s64(sum + 500, 1000), 0,
+		                 DYNAMIC_VAL_MAX);
+	return result;
+}
+
+s8 dynamic_val_get(struct dynamic_val *value,
+                   struct kraken_driver_data *driver_data)
+{
+	size_t i = 0;
+	return dynamic_val_eval(value, &i, driver_data);
+}
+
+static int dynamic_val_parse_node(struct dynamic_val *value, const char **buf,
+                                  struct device *dev, const char *attr);
+
+static int dynamic_val_parse_operands(struct dynamic_val *value,
+                                      struct dynamic_val_node *node,
+                                      const char **buf,
+                                      struct device *dev, const char *attr)
+{
+	char word[WORD_LEN_MAX + 1];
+	int ret = dynamic_val_scan(buf, word);
+	if (ret || strcmp(word, "(") != 0) {
+		dev_warn(dev, "%s: missing ( of dynamic value operands\n",
+		         attr);
+		return ret ? ret : -EINVAL;
+	}
+	do {
+		const char *weight_buf = *buf;
+		const size_t operand = value->len;
+		s32 weight = 1000;
+		// the operands of a sum may be preceded by their weights
+		if (node->op == DYNAMIC_VAL_OP_SUM &&
+		    (dynamic_val_scan(buf, word) ||
+		     str_parse_milli(word, &weight)))
+			*buf = weight_buf;
+		ret = dynamic_val_parse_node(value, buf, dev, attr);
+		if (ret)
+			return ret;
+		value->nodes[operand].weight = weight;
+		node->operands++;
+
+		ret = dynamic_val_scan(buf, word);
+		if (ret) {
+			dev_warn(dev, "%s: missing ) of dynamic value operands\n",
+			         attr);
+			return ret;
+		}
+	} while (strcmp(word, ",") == 0);
+	if (strcmp(word, ")") != 0) {
+		dev_warn(dev, "%s: expected , or ) instead of %s\n", attr,
+		         word);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static int dynamic_val_parse_node(struct dynamic_val *value, const char **buf,
+                                  struct device *dev, const char *attr)
+{
+	struct dynamic_val_node *node;
 	char source[WORD_LEN_MAX + 1];
-	int ret = str_scan_word(buf, source);
+	int ret;
+	if (value->len >= DYNAMIC_VAL_NODES_MAX) {
+		dev_warn(dev, "%s: more than %zu dynamic value nodes\n", attr,
+		         DYNAMIC_VAL_NODES_MAX);
+		return -E2BIG;
+	}
+	node = &value->nodes[value->len++];
+	node->get = NULL;
+	node->op = DYNAMIC_VAL_OP_MAX;
+	node->operands = 0;
+	node->weight = 1000;
+
+	ret = dynamic_val_scan(buf, source);
 	if (ret) {
 		dev_warn(dev, "%s: missing dynamic value source\n", attr);
 		return ret;
 	}
 	ret = 0;
-	if (strcasecmp(source, "temp_liquid") == 0) {
-		value->get = dynamic_val_temp_liquid;
+	if (strcasecmp(source, "max") == 0) {
+		node->op = DYNAMIC_VAL_OP_MAX;
+		ret = dynamic_val_parse_operands(value, node, buf, dev, attr);
+	} else if (strcasecmp(source, "min") == 0) {
+		node->op = DYNAMIC_VAL_OP_MIN;
+		ret = dynamic_val_parse_operands(value, node, buf, dev, attr);
+	} else if (strcasecmp(source, "sum") == 0) {
+		node->op = DYNAMIC_VAL_OP_SUM;
+		ret = dynamic_val_parse_operands(value, node, buf, dev, attr);
+	} else if (strcasecmp(source, "temp_liquid") == 0) {
+		node->get = dynamic_val_temp_liquid;
 	} else if (strcasecmp(source, "fan_rpm") == 0) {
-		value->get = dynamic_val_fan_rpm;
-		ret = dynamic_val_parse_normalized(value, buf, dev, attr);
+		node->get = dynamic_val_fan_rpm;
+		ret = dynamic_val_parse_normalized(node, buf, dev, attr);
 	} else if (strcasecmp(source, "pump_rpm") == 0) {
-		value->get = dynamic_val_pump_rpm;
-		ret = dynamic_val_parse_normalized(value, buf, dev, attr);
+		node->get = dynamic_val_pump_rpm;
+		ret = dynamic_val_parse_normalized(node, buf, dev, attr);
+	} else if (strcasecmp(source, "thermal_zone") == 0) {
+		node->get = dynamic_val_thermal_zone;
+		ret = dynamic_val_parse_thermal_zone(node, buf, dev, attr);
+	} else if (strcasecmp(source, "external") == 0) {
+		node->get = dynamic_val_external;
+		ret = dynamic_val_parse_external(node, buf, dev, attr);
 	} else {
 		dev_warn(dev, "%s: illegal dynamic value source %s\n", attr,
 		         source);
@@ -86,3 +407,10 @@ int dynamic_val_parse(struct dynamic_val *value, const char **buf,
 	}
 	return ret;
 }
+
+int dynamic_val_parse(struct dynamic_val *value, const char **buf,
+                      struct device *dev, const char *attr)
+{
+	value->len = 0;
+	return dynamic_val_parse_node(value, buf, dev, attr);
+}
@@ -3,6 +3,8 @@
 
 #include "../common.h"
 
+#include <linux/seqlock.h>
+
 /**
  * Legal values for dynamic_val are in [0, DYNAMIC_VAL_MAX].
  */
@@ -10,16 +12,87 @@
 
 #define DYNAMIC_VAL_STATE_SIZE ((size_t) 32)
 
-struct dynamic_val {
-	// gets the dynamic value; must return negative iff an error occurs
+/**
+ * A value fed by userspace through the external_value attribute, for the
+ * external source.
+ */
+struct dynamic_val_external {
+	seqlock_t lock;
+	s8 value;
+	// jiffies at the last write; only meaningful if written
+	unsigned long updated;
+	bool written;
+};
+
+void dynamic_val_external_init(struct dynamic_val_external *external);
+
+/**
+ * Stores value, which must be in [0, DYNAMIC_VAL_MAX], as of now.
+ */
+void dynamic_val_external_set(struct dynamic_val_external *external, s8 value);
+
+/**
+ * Returns the last value stored, or -ENODATA if none has been.
+ */
+s8 dynamic_val_external_get(struct dynamic_val_external *external);
+
+/**
+ * The most sources and operators a dynamic value can be composed of.
+ */
+#define DYNAMIC_VAL_NODES_MAX  ((size_t) 8)
+
+enum dynamic_val_op {
+	DYNAMIC_VAL_OP_MAX,
+	DYNAMIC_VAL_OP_MIN,
+	// the operands times their weights, added up
+	DYNAMIC_VAL_OP_SUM,
+};
+
+/**
+ * A source, or an operator applied to the operands following it.
+ */
+struct dynamic_val_node {
+	// gets the source's value; must return negative iff an error occurs.  NULL
+	// for an operator.
 	s8 (*get)(void *state, struct kraken_driver_data *driver_data);
 	// any state needed by get may be stored here
 	u8 state[DYNAMIC_VAL_STATE_SIZE];
+	enum dynamic_val_op op;
+	u8 operands;
+	// thousandths the node is weighted by as an operand of a sum
+	s32 weight;
+};
+
+/**
+ * An expression tree of sources and operators, its nodes in prefix order.
+ */
+struct dynamic_val {
+	size_t len;
+	struct dynamic_val_node nodes[DYNAMIC_VAL_NODES_MAX];
 };
 
 s8 dynamic_val_const_0(void *state, struct kraken_driver_data *driver_data);
 s8 dynamic_val_temp_liquid(void *state, struct kraken_driver_data *driver_data);
 
+/**
+ * Sets the value to the single source get.
+ */
+void dynamic_val_init(struct dynamic_val *value,
+                      s8 (*get)(void *state,
+                                struct kraken_driver_data *driver_data));
+
+/**
+ * Evaluates the value; negative iff any of its sources fails.
+ */
+s8 dynamic_val_get(struct dynamic_val *value,
+                   struct kraken_driver_data *driver_data);
+
+/**
+ * Parses a source: temp_liquid, fan_rpm max, pump_rpm max, thermal_zone type
+ * or external timeout_ms, or an operator max, min or sum with its operands in
+ * parentheses, separated by commas.  Temperatures are in °C, clamped to
+ * [0, DYNAMIC_VAL_MAX].
+ */
 int dynamic_val_parse(struct dynamic_val *value, const char **buf,
                       struct device *dev, const char *attr);
 
@@ -327,19 +327,30 @@ void led_data_init(struct led_data *data, enum led_which which)
 	mutex_init(&data->mutex);
 }
 
-static int led_batch_update(struct led_batch *batch, struct usb_kraken *kraken)
+void led_data_invalidate(struct led_data *data)
 {
-	int ret, sent;
+	mutex_lock(&data->mutex);
+	data->value_prev = -1;
+	data->batch_prev = NULL;
+	mutex_unlock(&data->mutex);
+}
+
+static int led_batch_update(struct led_batch *batch, struct transfer *transfers)
+{
+	int ret;
 	u8 i;
+	// the cycles are only sent together, so that they are queued on the
+	// endpoint in order
+	for (i = 0; i < batch->len; i++)
+		if (atomic_read(&transfers[i].busy))
+			return -EBUSY;
 	for (i = 0; i < batch->len; i++) {
-		ret = usb_interrupt_msg(
-			kraken->udev, usb_sndctrlpipe(kraken->udev, 1),
-			batch->cycles[i].msg, sizeof(batch->cycles[i].msg),
-			&sent, 1000);
-		if (ret || sent != sizeof(batch->cycles[i].msg)) {
-			dev_err(&kraken->udev->dev,
-			        "failed to set LED cycle %u\n", i);
-			return ret ? ret : 1;
+		ret = transfer_submit(&transfers[i], batch->cycles[i].msg,
+		                      sizeof(batch->cycles[i].msg));
+		if (ret) {
+			dev_err(&transfers[i].data->kraken->udev->dev,
+			        "failed to set LED cycle %u: %d\n", i, ret);
+			return ret;
 		}
 	}
 	return 0;
@@ -356,13 +367,11 @@ int kraken_x62_update_led(struct usb_kraken *kraken, struct led_data *data)
 	case LED_DATA_UPDATE_NONE:
 		goto error;
 	case LED_DATA_UPDATE_STATIC:
-		data->update = LED_DATA_UPDATE_NONE;
-		break;
 	case LED_DATA_UPDATE_DYNAMIC:
 		break;
 	}
 
-	value = data->value.get(data->value.state, kraken->data);
+	value = dynamic_val_get(&data->value, kraken->data);
 	if (value < 0) {
 		dev_err(&kraken->udev->dev,
 		        "error getting value for dynamic LED update: %d\n",
@@ -371,19 +380,30 @@ int kraken_x62_update_led(struct usb_kraken *kraken, struct led_data *data)
 		goto error;
 	}
 	// if same value as previously, no update necessary
-	if (value == data->value_prev)
+	if (value == data->value_prev) {
+		transfer_skip(&data->transfers[0], "value");
 		goto error;
+	}
 	batch = &data->batches[value];
 	// if same message as previously, no update necessary
 	if (data->batch_prev != NULL &&
-	    memcmp(batch, data->batch_prev, sizeof(*batch)) == 0)
+	    memcmp(batch, data->batch_prev, sizeof(*batch)) == 0) {
+		transfer_skip(&data->transfers[0], "message");
 		goto error;
+	}
 
-	ret = led_batch_update(batch, kraken);
-	if (ret)
+	ret = led_batch_update(batch, data->transfers);
+	if (ret) {
+		// previous batch still in flight: retry on the next update
+		if (ret == -EBUSY)
+			ret = 0;
 		goto error;
+	}
 	data->value_prev = value;
 	data->batch_prev = batch;
+	// a static batch only needs to be sent once
+	if (data->update == LED_DATA_UPDATE_STATIC)
+		data->update = LED_DATA_UPDATE_NONE;
 
 error:
 	mutex_unlock(&data->mutex);
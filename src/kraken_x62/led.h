@@ -2,6 +2,7 @@
 #define LEVIATHAN_X62_LED_H_INCLUDED
 
 #include "dynamic.h"
+#include "transfer.h"
 #include "../common.h"
 
 #include <linux/mutex.h>
@@ -123,11 +124,19 @@ struct led_data {
 	// current one, as an update would have no effect then
 	s8 value_prev;
 	struct led_batch *batch_prev;
+	// transfers[i] sends the message of cycle i
+	struct transfer transfers[LED_BATCH_CYCLES_SIZE];
 	struct mutex mutex;
 };
 
 void led_data_init(struct led_data *data, enum led_which which);
 
+/**
+ * Forgets the previously sent batch so that the next update sends one
+ * regardless.
+ */
+void led_data_invalidate(struct led_data *data);
+
 int kraken_x62_update_led(struct usb_kraken *kraken, struct led_data *data);
 
 #endif  /* LEVIATHAN_X62_LED_H_INCLUDED */
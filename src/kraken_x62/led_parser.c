@@ -300,7 +300,7 @@ static int led_parser_static(struct led_parser *parser)
 	int ret;
 	// static is implemented with a constant-0 value and the single batch
 	// being stored at index 0
-	parser->data->value.get = dynamic_val_const_0;
+	dynamic_val_init(&parser->data->value, dynamic_val_const_0);
 	ret = led_parser_batch(parser, &parser->data->batches[0]);
 	if (ret)
 		return ret;
@@ -1,25 +1,44 @@
 /* Driver for 1e71:170e devices.
  */
 
+#include "channel.h"
 #include "driver_data.h"
+#include "dynamic.h"
 #include "led.h"
 #include "led_parser.h"
 #include "percent.h"
+#include "stats.h"
 #include "status.h"
+#include "trace.h"
+#include "transfer.h"
 #include "../common.h"
+#include "../hwmon.h"
 #include "../util.h"
 
 #include <asm/byteorder.h>
+#include <linux/debugfs.h>
+#include <linux/hwmon.h>
 #include <linux/module.h>
+#include <linux/mm.h>
 #include <linux/mutex.h>
+#include <linux/seq_file.h>
 #include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/sysfs.h>
 #include <linux/usb.h>
+#include <linux/workqueue.h>
 
 #define DRIVER_NAME "kraken_x62"
 
 static void kraken_driver_data_init(struct kraken_driver_data *data)
 {
+	size_t i;
+	for (i = 0; i < CHANNELS_SIZE; i++) {
+		channel_data_init(&data->channels[i]);
+		transfer_stats_init(&data->transfer_stats[i]);
+	}
 	status_data_init(&data->status);
+	dynamic_val_external_init(&data->external);
 	percent_data_init(&data->percent_fan, PERCENT_MSG_WHICH_FAN);
 	percent_data_init(&data->percent_pump, PERCENT_MSG_WHICH_PUMP);
 	led_data_init(&data->led_logo, LED_WHICH_LOGO);
@@ -27,19 +46,137 @@ static void kraken_driver_data_init(struct kraken_driver_data *data)
 	led_data_init(&data->leds_sync, LED_WHICH_SYNC);
 }
 
+static void kraken_driver_data_invalidate(struct kraken_driver_data *data)
+{
+	percent_data_invalidate(&data->percent_fan);
+	percent_data_invalidate(&data->percent_pump);
+	led_data_invalidate(&data->led_logo);
+	led_data_invalidate(&data->leds_ring);
+	led_data_invalidate(&data->leds_sync);
+}
+
+/**
+ * Makes the channel's data be sent again on the next update, since the device
+ * may not have received it.
+ */
+static void kraken_x62_channel_invalidate(struct kraken_driver_data *data,
+                                          enum channel channel)
+{
+	switch (channel) {
+	case CHANNEL_FAN:
+		percent_data_invalidate(&data->percent_fan);
+		break;
+	case CHANNEL_PUMP:
+		percent_data_invalidate(&data->percent_pump);
+		break;
+	case CHANNEL_LOGO:
+		led_data_invalidate(&data->led_logo);
+		break;
+	case CHANNEL_RING:
+		led_data_invalidate(&data->leds_ring);
+		break;
+	case CHANNEL_SYNC:
+		led_data_invalidate(&data->leds_sync);
+		break;
+	case CHANNEL_STATUS:
+	case CHANNELS_SIZE:
+		break;
+	}
+}
+
+/**
+ * Accounts for a failure of the channel, unless error is 0.  Returns error if
+ * the channel is a cooling one, and 0 otherwise.
+ */
+static int kraken_x62_channel_account(struct kraken_driver_data *data,
+                                      enum channel channel, int error)
+{
+	if (!error)
+		return 0;
+	channel_data_account(&data->channels[channel], error);
+	dev_err_ratelimited(&data->kraken->udev->dev,
+	                    "failed %s update: %d\n", channel_name(channel),
+	                    error);
+	kraken_x62_channel_invalidate(data, channel);
+	return channel_cooling(channel) ? error : 0;
+}
+
+static void kraken_x62_send_work(struct work_struct *send_work)
+{
+	struct kraken_driver_data *data
+		= container_of(send_work, struct kraken_driver_data, send_work);
+	struct usb_kraken *kraken = data->kraken;
+
+	// each channel is updated regardless of the others' failures, cooling
+	// ones first; the failures are accounted for on the next update
+	channel_data_fail(&data->channels[CHANNEL_FAN],
+	                  kraken_x62_update_percent(kraken, &data->percent_fan));
+	channel_data_fail(&data->channels[CHANNEL_PUMP],
+	                  kraken_x62_update_percent(kraken,
+	                                            &data->percent_pump));
+	channel_data_fail(&data->channels[CHANNEL_LOGO],
+	                  kraken_x62_update_led(kraken, &data->led_logo));
+	channel_data_fail(&data->channels[CHANNEL_RING],
+	                  kraken_x62_update_led(kraken, &data->leds_ring));
+	channel_data_fail(&data->channels[CHANNEL_SYNC],
+	                  kraken_x62_update_led(kraken, &data->leds_sync));
+}
+
+static void kraken_x62_status_complete(struct transfer *transfer)
+{
+	struct kraken_driver_data *data = transfer->context;
+	int ret = status_data_receive(&data->status, data->kraken,
+	                              transfer->buf);
+	if (ret) {
+		channel_data_fail(&data->channels[CHANNEL_STATUS], ret);
+		return;
+	}
+	if (!READ_ONCE(data->status.stream)) {
+		schedule_work(&data->send_work);
+		return;
+	}
+	// streaming: the update only needs to send, see kraken_driver_update()
+	ret = transfer_resubmit(transfer);
+	// an update may have submitted it once busy was cleared, which will do
+	if (ret == -EBUSY)
+		ret = 0;
+	channel_data_fail(&data->channels[CHANNEL_STATUS], ret);
+}
+
 int kraken_driver_update(struct usb_kraken *kraken)
 {
 	struct kraken_driver_data *data = kraken->data;
-
-	int ret;
-	if ((ret = kraken_x62_update_status(kraken, &data->status)) ||
-	    (ret = kraken_x62_update_percent(kraken, &data->percent_fan)) ||
-	    (ret = kraken_x62_update_percent(kraken, &data->percent_pump)) ||
-	    (ret = kraken_x62_update_led(kraken, &data->led_logo)) ||
-	    (ret = kraken_x62_update_led(kraken, &data->leds_ring)) ||
-	    (ret = kraken_x62_update_led(kraken, &data->leds_sync)))
-		return ret;
-	return 0;
+	const ktime_t start = ktime_get();
+	enum channel channel;
+	int ret = 0;
+	int err;
+
+	trace_kraken_x62_update_start(&kraken->udev->dev);
+	// the messages of the previous update may have failed asynchronously;
+	// only failures of the cooling channels fail the update
+	transfer_data_expire(&data->transfers);
+	for (channel = 0; channel < CHANNELS_SIZE; channel++) {
+		err = kraken_x62_channel_account(
+			data, channel,
+			channel_data_collect(&data->channels[channel]));
+		if (!ret)
+			ret = err;
+	}
+	// the rest of the update is done by kraken_x62_send_work() once the
+	// status has arrived, unless it is streamed: then the latest status is
+	// used right away, and the status request only re-arms the stream if it
+	// stopped
+	err = kraken_x62_channel_account(
+		data, CHANNEL_STATUS,
+		kraken_x62_update_status(kraken, &data->status));
+	if (!err && READ_ONCE(data->status.stream))
+		schedule_work(&data->send_work);
+	if (!ret)
+		ret = err;
+
+	trace_kraken_x62_update_end(&kraken->udev->dev, ret,
+	                            ktime_to_ns(ktime_sub(ktime_get(), start)));
+	return ret;
 }
 
 static ssize_t serial_no_show(struct device *dev, struct device_attribute *attr,
@@ -112,6 +249,161 @@ static ssize_t footer_2_show(struct device *dev, struct device_attribute *attr,
 
 static DEVICE_ATTR_RO(footer_2);
 
+static ssize_t status_show(struct device *dev, struct device_attribute *attr,
+                           char *buf)
+{
+	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
+	u8 msg[STATUS_DATA_MSG_SIZE];
+	ktime_t captured;
+	status_data_get(&kraken->data->status, msg, &captured);
+	return scnprintf(buf, PAGE_SIZE,
+	                 "temp_liquid=%u\n"
+	                 "fan_rpm=%u\n"
+	                 "pump_rpm=%u\n"
+	                 "unknown_1=%u\n"
+	                 "unknown_2=%u\n"
+	                 "footer_2=%u\n"
+	                 "captured_ns=%lld\n",
+	                 status_msg_temp_liquid(msg), status_msg_fan_rpm(msg),
+	                 status_msg_pump_rpm(msg), status_msg_unknown_1(msg),
+	                 status_msg_unknown_2(msg), status_msg_footer_2(msg),
+	                 ktime_to_ns(captured));
+}
+
+static DEVICE_ATTR_RO(status);
+
+static ssize_t status_raw_read(struct file *file, struct kobject *kobj,
+                               struct bin_attribute *attr, char *buf,
+                               loff_t off, size_t count)
+{
+	struct usb_kraken *kraken
+		= usb_get_intfdata(to_usb_interface(kobj_to_dev(kobj)));
+	struct status_raw raw;
+	ktime_t captured;
+	status_data_get(&kraken->data->status, raw.msg, &captured);
+	raw.captured_ns = ktime_to_ns(captured);
+	return memory_read_from_buffer(buf, count, &off, &raw, sizeof(raw));
+}
+
+static BIN_ATTR_RO(status_raw, sizeof(struct status_raw));
+
+static ssize_t status_stream_show(struct device *dev,
+                                  struct device_attribute *attr, char *buf)
+{
+	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
+	struct status_data *status = &kraken->data->status;
+	return scnprintf(buf, PAGE_SIZE, "%d\n", READ_ONCE(status->stream));
+}
+
+static ssize_t status_stream_store(struct device *dev,
+                                   struct device_attribute *attr,
+                                   const char *buf, size_t count)
+{
+	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
+	struct status_data *status = &kraken->data->status;
+	bool stream;
+	int ret = kstrtobool(buf, &stream);
+	if (ret)
+		return ret;
+	WRITE_ONCE(status->stream, stream);
+	WRITE_ONCE(status->transfer.untimed, stream);
+	// start streaming right away rather than on the next update; the update
+	// arms the stream under update_mutex, so never during a reset
+	if (stream)
+		kraken_update_kick(kraken);
+	return count;
+}
+
+static DEVICE_ATTR_RW(status_stream);
+
+static ssize_t channel_failures_show(struct device *dev,
+                                     struct device_attribute *attr, char *buf)
+{
+	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
+	enum channel channel;
+	ssize_t len = 0;
+	for (channel = 0; channel < CHANNELS_SIZE; channel++)
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%s %u\n",
+		                 channel_name(channel),
+		                 channel_data_failures(
+			                 &kraken->data->channels[channel]));
+	return len;
+}
+
+static DEVICE_ATTR_RO(channel_failures);
+
+/**
+ * An attribute showing a value of a status field over a window, named
+ * <field>_<value>_<window>.
+ */
+struct stats_attribute {
+	struct device_attribute attr;
+	enum stats_field field;
+	enum stats_window window;
+	enum stats_value value;
+};
+
+static ssize_t stats_attr_show(struct device *dev,
+                               struct device_attribute *attr, char *buf)
+{
+	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
+	const struct stats_attribute *stats_attr
+		= container_of(attr, struct stats_attribute, attr);
+	u32 out;
+	int ret = stats_data_get(&kraken->data->status.stats, stats_attr->field,
+	                         stats_attr->window, stats_attr->value, &out);
+	if (ret)
+		return ret;
+	return scnprintf(buf, PAGE_SIZE, "%u\n", out);
+}
+
+#define STATS_ATTR(_field, _FIELD, _value, _VALUE, _window, _WINDOW) \
+	static struct stats_attribute \
+	stats_attr_##_field##_##_value##_##_window = { \
+		.attr = __ATTR(_field##_##_value##_##_window, 0444, \
+		               stats_attr_show, NULL), \
+		.field = STATS_FIELD_##_FIELD, \
+		.window = STATS_WINDOW_##_WINDOW, \
+		.value = STATS_VALUE_##_VALUE, \
+	}
+
+#define STATS_ATTRS_WINDOW(_field, _FIELD, _window, _WINDOW) \
+	STATS_ATTR(_field, _FIELD, min, MIN, _window, _WINDOW); \
+	STATS_ATTR(_field, _FIELD, max, MAX, _window, _WINDOW); \
+	STATS_ATTR(_field, _FIELD, mean, MEAN, _window, _WINDOW); \
+	STATS_ATTR(_field, _FIELD, p95, P95, _window, _WINDOW)
+
+#define STATS_ATTRS(_field, _FIELD) \
+	STATS_ATTRS_WINDOW(_field, _FIELD, 1m, 1M); \
+	STATS_ATTRS_WINDOW(_field, _FIELD, 5m, 5M); \
+	STATS_ATTRS_WINDOW(_field, _FIELD, 15m, 15M)
+
+STATS_ATTRS(temp_liquid, TEMP_LIQUID);
+STATS_ATTRS(fan_rpm, FAN_RPM);
+STATS_ATTRS(pump_rpm, PUMP_RPM);
+
+#define STATS_ATTR_PTRS_WINDOW(_field, _window) \
+	&stats_attr_##_field##_min_##_window.attr.attr, \
+	&stats_attr_##_field##_max_##_window.attr.attr, \
+	&stats_attr_##_field##_mean_##_window.attr.attr, \
+	&stats_attr_##_field##_p95_##_window.attr.attr
+
+#define STATS_ATTR_PTRS(_field) \
+	STATS_ATTR_PTRS_WINDOW(_field, 1m), \
+	STATS_ATTR_PTRS_WINDOW(_field, 5m), \
+	STATS_ATTR_PTRS_WINDOW(_field, 15m)
+
+static struct attribute *stats_attrs[] = {
+	STATS_ATTR_PTRS(temp_liquid),
+	STATS_ATTR_PTRS(fan_rpm),
+	STATS_ATTR_PTRS(pump_rpm),
+	NULL,
+};
+
+static const struct attribute_group stats_group = {
+	.attrs = stats_attrs,
+};
+
 static ssize_t attr_percent_store(struct percent_data *data, struct device *dev,
                                   struct device_attribute *attr,
                                   const char *buf, size_t count)
@@ -128,6 +420,7 @@ static ssize_t attr_percent_store(struct percent_data *data, struct device *dev,
 	mutex_unlock(&parser.data->mutex);
 	if (ret)
 		return -EINVAL;
+	kraken_update_kick(usb_get_intfdata(to_usb_interface(dev)));
 	return count;
 }
 
@@ -169,6 +462,7 @@ static ssize_t attr_led_store(struct led_data *data, struct device *dev,
 	mutex_unlock(&parser.data->mutex);
 	if (ret)
 		return -EINVAL;
+	kraken_update_kick(usb_get_intfdata(to_usb_interface(dev)));
 	return count;
 }
 
@@ -201,8 +495,37 @@ static ssize_t leds_sync_store(struct device *dev,
 
 static DEVICE_ATTR_WO(leds_sync);
 
+static ssize_t external_value_show(struct device *dev,
+                                   struct device_attribute *attr, char *buf)
+{
+	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
+	const s8 value = dynamic_val_external_get(&kraken->data->external);
+	if (value < 0)
+		return value;
+	return scnprintf(buf, PAGE_SIZE, "%d\n", value);
+}
+
+static ssize_t external_value_store(struct device *dev,
+                                    struct device_attribute *attr,
+                                    const char *buf, size_t count)
+{
+	struct usb_kraken *kraken = usb_get_intfdata(to_usb_interface(dev));
+	u8 value;
+	int ret = kstrtou8(buf, 0, &value);
+	if (ret)
+		return ret;
+	if (value > DYNAMIC_VAL_MAX)
+		return -EINVAL;
+	dynamic_val_external_set(&kraken->data->external, value);
+	kraken_update_kick(kraken);
+	return count;
+}
+
+static DEVICE_ATTR_RW(external_value);
+
 int kraken_driver_create_device_files(struct usb_interface *interface)
 {
+	struct usb_kraken *kraken = usb_get_intfdata(interface);
 	int ret;
 	if ((ret = device_create_file(&interface->dev, &dev_attr_serial_no)))
 		goto error_serial_no;
@@ -218,6 +541,19 @@ int kraken_driver_create_device_files(struct usb_interface *interface)
 		goto error_unknown_2;
 	if ((ret = device_create_file(&interface->dev, &dev_attr_footer_2)))
 		goto error_footer_2;
+	if ((ret = device_create_file(&interface->dev, &dev_attr_status)))
+		goto error_status;
+	if ((ret = device_create_bin_file(&interface->dev,
+	                                  &bin_attr_status_raw)))
+		goto error_status_raw;
+	if ((ret = device_create_file(&interface->dev,
+	                              &dev_attr_status_stream)))
+		goto error_status_stream;
+	if ((ret = device_create_file(&interface->dev,
+	                              &dev_attr_channel_failures)))
+		goto error_channel_failures;
+	if ((ret = sysfs_create_group(&interface->dev.kobj, &stats_group)))
+		goto error_stats;
 	if ((ret = device_create_file(&interface->dev, &dev_attr_fan_percent)))
 		goto error_fan_percent;
 	if ((ret = device_create_file(&interface->dev, &dev_attr_pump_percent)))
@@ -228,8 +564,16 @@ int kraken_driver_create_device_files(struct usb_interface *interface)
 		goto error_leds_ring;
 	if ((ret = device_create_file(&interface->dev, &dev_attr_leds_sync)))
 		goto error_leds_sync;
+	if ((ret = device_create_file(&interface->dev,
+	                              &dev_attr_external_value)))
+		goto error_external_value;
 
+	// NOTE: unwatched in kraken_driver_disconnect(), once no more status
+	// messages can arrive
+	status_data_watch(&kraken->data->status, &interface->dev.kobj);
 	return 0;
+error_external_value:
+	device_remove_file(&interface->dev, &dev_attr_leds_sync);
 error_leds_sync:
 	device_remove_file(&interface->dev, &dev_attr_leds_ring);
 error_leds_ring:
@@ -239,6 +583,16 @@ error_led_logo:
 error_pump_percent:
 	device_remove_file(&interface->dev, &dev_attr_fan_percent);
 error_fan_percent:
+	sysfs_remove_group(&interface->dev.kobj, &stats_group);
+error_stats:
+	device_remove_file(&interface->dev, &dev_attr_channel_failures);
+error_channel_failures:
+	device_remove_file(&interface->dev, &dev_attr_status_stream);
+error_status_stream:
+	device_remove_bin_file(&interface->dev, &bin_attr_status_raw);
+error_status_raw:
+	device_remove_file(&interface->dev, &dev_attr_status);
+error_status:
 	device_remove_file(&interface->dev, &dev_attr_footer_2);
 error_footer_2:
 	device_remove_file(&interface->dev, &dev_attr_unknown_2);
@@ -258,11 +612,17 @@ error_serial_no:
 
 void kraken_driver_remove_device_files(struct usb_interface *interface)
 {
+	device_remove_file(&interface->dev, &dev_attr_external_value);
 	device_remove_file(&interface->dev, &dev_attr_leds_sync);
 	device_remove_file(&interface->dev, &dev_attr_leds_ring);
 	device_remove_file(&interface->dev, &dev_attr_led_logo);
 	device_remove_file(&interface->dev, &dev_attr_pump_percent);
 	device_remove_file(&interface->dev, &dev_attr_fan_percent);
+	sysfs_remove_group(&interface->dev.kobj, &stats_group);
+	device_remove_file(&interface->dev, &dev_attr_channel_failures);
+	device_remove_file(&interface->dev, &dev_attr_status_stream);
+	device_remove_bin_file(&interface->dev, &bin_attr_status_raw);
+	device_remove_file(&interface->dev, &dev_attr_status);
 	device_remove_file(&interface->dev, &dev_attr_footer_2);
 	device_remove_file(&interface->dev, &dev_attr_unknown_2);
 	device_remove_file(&interface->dev, &dev_attr_unknown_1);
@@ -272,6 +632,130 @@ void kraken_driver_remove_device_files(struct usb_interface *interface)
 	device_remove_file(&interface->dev, &dev_attr_serial_no);
 }
 
+umode_t kraken_driver_pwm_is_visible(u32 attr, int channel)
+{
+	switch (attr) {
+	case hwmon_pwm_input:
+	case hwmon_pwm_enable:
+		return 0644;
+	default:
+		return 0;
+	}
+}
+
+static struct percent_data *kraken_x62_pwm_percent(struct usb_kraken *kraken,
+                                                   int channel)
+{
+	return channel == 0 ? &kraken->data->percent_fan
+	                    : &kraken->data->percent_pump;
+}
+
+int kraken_driver_pwm_read(struct usb_kraken *kraken, u32 attr, int channel,
+                           long *val)
+{
+	struct percent_data *percent = kraken_x62_pwm_percent(kraken, channel);
+	switch (attr) {
+	case hwmon_pwm_input:
+		*val = kraken_percent_to_pwm(percent_data_percent(percent));
+		return 0;
+	case hwmon_pwm_enable:
+		*val = percent_data_manual(percent) ? 1 : 2;
+		return 0;
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+int kraken_driver_pwm_write(struct usb_kraken *kraken, u32 attr, int channel,
+                            long val)
+{
+	struct percent_data *percent = kraken_x62_pwm_percent(kraken, channel);
+	switch (attr) {
+	case hwmon_pwm_input:
+		if (val < 0 || val > 255)
+			return -EINVAL;
+		// setting a duty cycle switches to manual mode
+		percent_data_set_manual(percent, kraken_pwm_to_percent(val));
+		return 0;
+	case hwmon_pwm_enable:
+		if (val == 1)
+			percent_data_set_manual(percent,
+			                        percent_data_percent(percent));
+		else if (val == 2)
+			percent_data_set_auto(percent);
+		else
+			return -EINVAL;
+		return 0;
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+static int kraken_x62_transfers_init(struct kraken_driver_data *data)
+{
+	struct led_data *leds[] = {
+		&data->led_logo, &data->leds_ring, &data->leds_sync,
+	};
+	struct usb_device *udev = data->kraken->udev;
+	const unsigned int pipe_in = usb_rcvintpipe(udev, 1);
+	const unsigned int pipe_out = usb_sndintpipe(udev, 1);
+	size_t i, j;
+
+	int ret;
+	if ((ret = transfer_init(&data->status.transfer, &data->transfers,
+	                         pipe_in, STATUS_DATA_MSG_SIZE)) ||
+	    (ret = transfer_init(&data->percent_fan.transfer, &data->transfers,
+	                         pipe_out, PERCENT_MSG_SIZE)) ||
+	    (ret = transfer_init(&data->percent_pump.transfer, &data->transfers,
+	                         pipe_out, PERCENT_MSG_SIZE)))
+		return ret;
+	for (i = 0; i < ARRAY_SIZE(leds); i++)
+		for (j = 0; j < LED_BATCH_CYCLES_SIZE; j++) {
+			ret = transfer_init(&leds[i]->transfers[j],
+			                    &data->transfers, pipe_out,
+			                    LED_MSG_SIZE);
+			if (ret)
+				return ret;
+		}
+
+	data->status.transfer.complete = kraken_x62_status_complete;
+	data->status.transfer.context = data;
+	data->status.transfer.error = &data->channels[CHANNEL_STATUS].error;
+	data->percent_fan.transfer.error = &data->channels[CHANNEL_FAN].error;
+	data->percent_pump.transfer.error = &data->channels[CHANNEL_PUMP].error;
+	data->status.transfer.name = channel_name(CHANNEL_STATUS);
+	data->percent_fan.transfer.name = channel_name(CHANNEL_FAN);
+	data->percent_pump.transfer.name = channel_name(CHANNEL_PUMP);
+	data->status.transfer.stats = &data->transfer_stats[CHANNEL_STATUS];
+	data->percent_fan.transfer.stats = &data->transfer_stats[CHANNEL_FAN];
+	data->percent_pump.transfer.stats = &data->transfer_stats[CHANNEL_PUMP];
+	for (i = 0; i < ARRAY_SIZE(leds); i++)
+		for (j = 0; j < LED_BATCH_CYCLES_SIZE; j++) {
+			leds[i]->transfers[j].error
+				= &data->channels[CHANNEL_LOGO + i].error;
+			leds[i]->transfers[j].name
+				= channel_name(CHANNEL_LOGO + i);
+			leds[i]->transfers[j].stats
+				= &data->transfer_stats[CHANNEL_LOGO + i];
+		}
+	return 0;
+}
+
+static void kraken_x62_transfers_free(struct kraken_driver_data *data)
+{
+	struct led_data *leds[] = {
+		&data->led_logo, &data->leds_ring, &data->leds_sync,
+	};
+	size_t i, j;
+
+	transfer_free(&data->status.transfer);
+	transfer_free(&data->percent_fan.transfer);
+	transfer_free(&data->percent_pump.transfer);
+	for (i = 0; i < ARRAY_SIZE(leds); i++)
+		for (j = 0; j < LED_BATCH_CYCLES_SIZE; j++)
+			transfer_free(&leds[i]->transfers[j]);
+}
+
 static int kraken_x62_initialize(struct usb_kraken *kraken,
                                  char serial_number[])
 {
@@ -279,12 +763,13 @@ static int kraken_x62_initialize(struct usb_kraken *kraken,
 	u8 i;
 	int ret = -ENOMEM;
 	// NOTE: the data buffer of usb_*_msg() must be DMA capable, so data
-	// cannot be stack allocated.
+	// cannot be stack allocated.  (It is mapped for DMA by the USB core, so
+	// it need not come from ZONE_DMA.)
 	//
 	// Space for length byte, type-of-data byte, and serial number encoded
 	// UTF-16.
 	const size_t data_size = 2 + (DATA_SERIAL_NUMBER_SIZE - 1) * 2;
-	u8 *data = kmalloc(data_size, GFP_KERNEL | GFP_DMA);
+	u8 *data = kmalloc(data_size, GFP_KERNEL);
 	if (data == NULL)
 		goto error_data;
 
@@ -334,6 +819,46 @@ error_data:
 	return ret;
 }
 
+int kraken_driver_pre_reset(struct usb_kraken *kraken)
+{
+	struct kraken_driver_data *data = kraken->data;
+	// a status arriving while the transfers are killed may queue the send
+	// work, which may in turn submit more of them
+	transfer_data_kill(&data->transfers);
+	cancel_work_sync(&data->send_work);
+	transfer_data_kill(&data->transfers);
+	return 0;
+}
+
+int kraken_driver_post_reset(struct usb_kraken *kraken)
+{
+	struct kraken_driver_data *data = kraken->data;
+	size_t i;
+	int ret;
+	// the errors of the killed transfers are stale, and the device has
+	// forgotten all settings
+	for (i = 0; i < CHANNELS_SIZE; i++)
+		channel_data_collect(&data->channels[i]);
+	kraken_driver_data_invalidate(data);
+	ret = kraken_x62_initialize(kraken, data->serial_number);
+	if (ret)
+		dev_err(&kraken->udev->dev, "failed to initialize: %d\n", ret);
+	return ret;
+}
+
+static int kraken_x62_debugfs_channels_show(struct seq_file *seq, void *unused)
+{
+	struct kraken_driver_data *data = seq->private;
+	enum channel channel;
+	for (channel = 0; channel < CHANNELS_SIZE; channel++) {
+		seq_printf(seq, "%s\n", channel_name(channel));
+		transfer_stats_show(seq, &data->transfer_stats[channel]);
+	}
+	return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(kraken_x62_debugfs_channels);
+
 int kraken_driver_probe(struct usb_interface *interface,
                         const struct usb_device_id *id)
 {
@@ -341,24 +866,43 @@ int kraken_driver_probe(struct usb_interface *interface,
 	struct usb_kraken *kraken = usb_get_intfdata(interface);
 
 	int ret = -ENOMEM;
-	kraken->data = kzalloc(sizeof(*kraken->data), GFP_KERNEL | GFP_DMA);
+	// NOTE: the LED and percent tables make the data too large to reliably
+	// get physically contiguous memory for it; it is never used for DMA,
+	// since the messages are copied into the transfers' buffers
+	kraken->data = kvzalloc(sizeof(*kraken->data), GFP_KERNEL);
 	if (kraken->data == NULL)
 		goto error_data;
 	data = kraken->data;
+	data->kraken = kraken;
 
 	kraken_driver_data_init(data);
+	transfer_data_init(&data->transfers, kraken);
+	INIT_WORK(&data->send_work, &kraken_x62_send_work);
+
+	ret = kraken_x62_transfers_init(data);
+	if (ret) {
+		dev_err(&interface->dev, "failed to allocate transfers: %d\n",
+		        ret);
+		goto error_transfers;
+	}
 
 	ret = kraken_x62_initialize(kraken, data->serial_number);
 	if (ret) {
 		dev_err(&interface->dev, "failed to initialize: %d\n", ret);
-		goto error_init_message;
+		goto error_transfers;
 	}
 
+	// removed in kraken_driver_disconnect(), before the data is freed
+	data->debugfs = debugfs_create_file("channels", 0444, kraken->debugfs,
+	                                    data,
+	                                    &kraken_x62_debugfs_channels_fops);
+
 	dev_info(&interface->dev, "device connected\n");
 
 	return 0;
-error_init_message:
-	kfree(data);
+error_transfers:
+	kraken_x62_transfers_free(data);
+	kvfree(data);
 error_data:
 	return ret;
 }
@@ -368,7 +912,12 @@ void kraken_driver_disconnect(struct usb_interface *interface)
 	struct usb_kraken *kraken = usb_get_intfdata(interface);
 	struct kraken_driver_data *data = kraken->data;
 
-	kfree(data);
+	debugfs_remove(data->debugfs);
+	transfer_data_stop(&data->transfers);
+	cancel_work_sync(&data->send_work);
+	status_data_unwatch(&data->status);
+	kraken_x62_transfers_free(data);
+	kvfree(data);
 
 	dev_info(&interface->dev, "device disconnected\n");
 }
@@ -384,12 +933,14 @@ static struct usb_driver kraken_x62_driver = {
 	.name       = DRIVER_NAME,
 	.probe      = kraken_probe,
 	.disconnect = kraken_disconnect,
+	.pre_reset  = kraken_pre_reset,
+	.post_reset = kraken_post_reset,
 	.id_table   = kraken_x62_id_table,
 };
 
 const char *kraken_driver_name = DRIVER_NAME;
 
-module_usb_driver(kraken_x62_driver);
+module_kraken_driver(kraken_x62_driver);
 
 MODULE_DESCRIPTION("driver for 1e71:170e devices (NZXT Kraken X62)");
 MODULE_LICENSE("GPL");
@@ -3,8 +3,13 @@
 
 #include "percent.h"
 #include "../common.h"
+#include "../netlink.h"
 #include "../util.h"
 
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+
 static const u8 PERCENT_MSG_HEADER[] = {
 	0x02, 0x4d,
 };
@@ -16,139 +21,267 @@ static void percent_msg_init(struct percent_msg *msg,
 	msg->msg[2] = (u8) which;
 }
 
-static enum percent_msg_which percent_msg_which_get(struct percent_msg *msg)
-{
-	const enum percent_msg_which which = msg->msg[2];
-	return which;
-}
-
 static void percent_msg_set(struct percent_msg *msg, u8 percent)
 {
 	msg->msg[4] = percent;
 }
 
 static int percent_msg_update(struct percent_msg *msg,
-                              struct usb_kraken *kraken)
+                              struct transfer *transfer)
 {
-	int sent;
-	int ret = usb_interrupt_msg(
-		kraken->udev, usb_sndctrlpipe(kraken->udev, 1),
-		msg->msg, sizeof(msg->msg), &sent, 1000);
-	if (ret || sent != sizeof(msg->msg)) {
-		dev_err(&kraken->udev->dev,
-		        "failed to set speed percent: I/O error\n");
-		return ret ? ret : 1;
-	}
-	return 0;
+	int ret = transfer_submit(transfer, msg->msg, sizeof(msg->msg));
+	if (ret && ret != -EBUSY)
+		dev_err(&transfer->data->kraken->udev->dev,
+		        "failed to set speed percent: %d\n", ret);
+	return ret;
 }
 
-static const u8 PERCENTS_SILENT_FAN[] = {
-	35,   35,  35,  35,  35,  35,  35,  35,  35,  35,
-	35,   35,  35,  35,  35,  35,  35,  35,  35,  35,
-	35,   35,  35,  35,  35,  35,  35,  35,  35,  35,
-	35,   35,  35,  35,  35,  35,  35,  35,  35,  35,
-	35,   37,  39,  41,  43,  45,  47,  49,  51,  53,
-	55,   59,  63,  67,  71,  75,  80,  85,  90,  95,
-	100, 100, 100, 100, 100, 100, 100, 100, 100, 100,
-	100, 100, 100, 100, 100, 100, 100, 100, 100, 100,
-	100, 100, 100, 100, 100, 100, 100, 100, 100, 100,
-	100, 100, 100, 100, 100, 100, 100, 100, 100, 100,
-	100,
+static const struct percent_point POINTS_SILENT_FAN[] = {
+	{  0,  35 }, { 40,  35 }, { 50,  55 }, { 55,  75 }, { 60, 100 },
 };
 
-static const u8 PERCENTS_SILENT_PUMP[] = {
-	60,   60,  60,  60,  60,  60,  60,  60,  60,  60,
-	60,   60,  60,  60,  60,  60,  60,  60,  60,  60,
-	60,   60,  60,  60,  60,  60,  60,  60,  60,  60,
-	60,   60,  60,  60,  60,  60,  62,  64,  66,  68,
-	70,   72,  74,  76,  78,  80,  82,  84,  86,  88,
-	90,   92,  94,  96,  98, 100, 100, 100, 100, 100,
-	100, 100, 100, 100, 100, 100, 100, 100, 100, 100,
-	100, 100, 100, 100, 100, 100, 100, 100, 100, 100,
-	100, 100, 100, 100, 100, 100, 100, 100, 100, 100,
-	100, 100, 100, 100, 100, 100, 100, 100, 100, 100,
-	100,
+static const struct percent_point POINTS_SILENT_PUMP[] = {
+	{  0,  60 }, { 35,  60 }, { 55, 100 },
 };
 
-static const u8 PERCENTS_PERFORMANCE_FAN[] = {
-	50,   50,  50,  50,  50,  50,  50,  50,  50,  50,
-	50,   50,  50,  50,  50,  50,  50,  50,  50,  50,
-	50,   50,  50,  50,  50,  50,  50,  50,  50,  50,
-	50,   50,  50,  50,  50,  50,  52,  54,  56,  58,
-	60,   62,  64,  66,  68,  70,  72,  74,  76,  78,
-	80,   82,  84,  86,  88,  90,  92,  94,  96,  98,
-	100, 100, 100, 100, 100, 100, 100, 100, 100, 100,
-	100, 100, 100, 100, 100, 100, 100, 100, 100, 100,
-	100, 100, 100, 100, 100, 100, 100, 100, 100, 100,
-	100, 100, 100, 100, 100, 100, 100, 100, 100, 100,
-	100,
+static const struct percent_point POINTS_PERFORMANCE_FAN[] = {
+	{  0,  50 }, { 35,  50 }, { 60, 100 },
 };
 
-static const u8 PERCENTS_PERFORMANCE_PUMP[] = {
-	70,   70,  70,  70,  70,  70,  70,  70,  70,  70,
-	70,   70,  70,  70,  70,  70,  70,  70,  70,  70,
-	70,   70,  70,  70,  70,  70,  70,  70,  70,  70,
-	70,   70,  70,  70,  70,  70,  72,  74,  76,  78,
-	80,   81,  82,  83,  84,  85,  86,  87,  88,  89,
-	90,   91,  92,  93,  94,  95,  96,  97,  98,  99,
-	100, 100, 100, 100, 100, 100, 100, 100, 100, 100,
-	100, 100, 100, 100, 100, 100, 100, 100, 100, 100,
-	100, 100, 100, 100, 100, 100, 100, 100, 100, 100,
-	100, 100, 100, 100, 100, 100, 100, 100, 100, 100,
-	100,
+static const struct percent_point POINTS_PERFORMANCE_PUMP[] = {
+	{  0,  70 }, { 35,  70 }, { 40,  80 }, { 60, 100 },
 };
 
-static void percent_data_set(struct percent_data *data, const u8 *percents)
+static void percent_curve_set(struct percent_curve *curve,
+                              const struct percent_point *points, size_t len)
+{
+	memcpy(curve->points, points, len * sizeof(*points));
+	curve->len = len;
+}
+
+/**
+ * Appends a point, unless it lies on the line through the previous point and
+ * the one before that, in which case it replaces the previous point.  The
+ * point's value must be greater than that of the last point.
+ */
+static void percent_curve_append(struct percent_curve *curve,
+                                 struct percent_point point)
+{
+	if (curve->len >= 2) {
+		const struct percent_point *a = &curve->points[curve->len - 2];
+		const struct percent_point *b = &curve->points[curve->len - 1];
+		if ((b->percent - a->percent) * (point.value - b->value) ==
+		    (point.percent - b->percent) * (b->value - a->value))
+			curve->len--;
+	}
+	curve->points[curve->len++] = point;
+}
+
+static u8 percent_curve_eval(const struct percent_curve *curve, u8 value)
 {
+	const struct percent_point *a, *b;
 	size_t i;
-	for (i = 0; i < ARRAY_SIZE(data->msgs); i++)
-		percent_msg_set(&data->msgs[i], percents[i]);
+	if (value <= curve->points[0].value)
+		return curve->points[0].percent;
+	for (i = 1; i < curve->len; i++) {
+		if (value > curve->points[i].value)
+			continue;
+		a = &curve->points[i - 1];
+		b = &curve->points[i];
+		return a->percent +
+		       DIV_ROUND_CLOSEST((b->percent - a->percent) *
+		                         (value - a->value),
+		                         b->value - a->value);
+	}
+	return curve->points[curve->len - 1].percent;
+}
+
+/**
+ * Resets the controller, starting its integral term from percent_min.
+ */
+static void percent_pid_reset(struct percent_pid *pid, u8 percent_min)
+{
+	pid->integral = percent_min * 1000;
+	pid->error_prev = 0;
+	pid->evaluated = ktime_set(0, 0);
+}
+
+static u8 percent_pid_eval(struct percent_pid *pid, s8 value, ktime_t now,
+                           u8 percent_min, u8 percent_max)
+{
+	const s64 out_min = percent_min * 1000;
+	const s64 out_max = percent_max * 1000;
+	const s64 error = value * 1000 - (s64) pid->setpoint;
+	s64 dt_ms = 0;
+	s64 out, integral;
+	if (ktime_to_ns(pid->evaluated) != 0)
+		dt_ms = clamp_t(s64, ktime_ms_delta(now, pid->evaluated), 0,
+		                PERCENT_PID_DT_MAX_MS);
+
+	out = div_s64(pid->kp * error, 1000);
+	if (dt_ms > 0)
+		out += div_s64(pid->kd * (error - pid->error_prev), dt_ms);
+	integral = clamp(pid->integral +
+	                 div_s64(pid->ki * error * dt_ms, 1000000),
+	                 out_min, out_max);
+	// anti-windup: the integral is left alone while the output is saturated
+	// in the direction it would move in
+	if (!(out + pid->integral >= out_max && error > 0) &&
+	    !(out + pid->integral <= out_min && error < 0))
+		pid->integral = integral;
+	out = clamp(out + pid->integral, out_min, out_max);
+
+	pid->error_prev = error;
+	pid->evaluated = now;
+	return div_s64(out + 500, 1000);
 }
 
 void percent_data_init(struct percent_data *data, enum percent_msg_which which)
 {
-	size_t i;
 	switch (which) {
 	case PERCENT_MSG_WHICH_FAN:
 		data->percent_min = 35;
 		data->percent_max = 100;
+		percent_curve_set(&data->curve, POINTS_SILENT_FAN,
+		                  ARRAY_SIZE(POINTS_SILENT_FAN));
 		break;
 	case PERCENT_MSG_WHICH_PUMP:
 		data->percent_min = 50;
 		data->percent_max = 100;
+		percent_curve_set(&data->curve, POINTS_SILENT_PUMP,
+		                  ARRAY_SIZE(POINTS_SILENT_PUMP));
 		break;
 	}
+	data->which = which;
 
 	data->update = true;
-	data->value.get = dynamic_val_temp_liquid;
-	for (i = 0; i < ARRAY_SIZE(data->msgs); i++)
-		percent_msg_init(&data->msgs[i], which);
-
-	switch (which) {
-	case PERCENT_MSG_WHICH_FAN:
-		percent_data_set(data, PERCENTS_SILENT_FAN);
-		break;
-	case PERCENT_MSG_WHICH_PUMP:
-		percent_data_set(data, PERCENTS_SILENT_PUMP);
-		break;
-	}
+	dynamic_val_init(&data->value, dynamic_val_temp_liquid);
+	data->mode = PERCENT_MODE_CURVE;
+	memset(&data->pid, 0, sizeof(data->pid));
+	memset(&data->limits, 0, sizeof(data->limits));
 	data->value_prev = -1;
-	data->msg_prev = NULL;
+	data->percent_prev = -1;
+	data->changed = ktime_set(0, 0);
+	data->settled = ktime_set(0, 0);
+
+	data->manual = false;
+	data->manual_percent = data->percent_max;
+	percent_msg_init(&data->msg, which);
+	data->applied = 0;
 
 	mutex_init(&data->mutex);
 }
 
+void percent_data_invalidate(struct percent_data *data)
+{
+	mutex_lock(&data->mutex);
+	data->value_prev = -1;
+	data->percent_prev = -1;
+	mutex_unlock(&data->mutex);
+}
+
+void percent_data_set_manual(struct percent_data *data, u8 percent)
+{
+	mutex_lock(&data->mutex);
+	data->manual_percent = clamp(percent, data->percent_min,
+	                             data->percent_max);
+	data->manual = true;
+	data->update = true;
+	data->value_prev = -1;
+	data->percent_prev = -1;
+	mutex_unlock(&data->mutex);
+}
+
+void percent_data_set_auto(struct percent_data *data)
+{
+	mutex_lock(&data->mutex);
+	if (data->manual) {
+		data->manual = false;
+		data->value_prev = -1;
+		data->percent_prev = -1;
+	}
+	mutex_unlock(&data->mutex);
+}
+
+bool percent_data_manual(struct percent_data *data)
+{
+	bool manual;
+	mutex_lock(&data->mutex);
+	manual = data->manual;
+	mutex_unlock(&data->mutex);
+	return manual;
+}
+
+u8 percent_data_percent(struct percent_data *data)
+{
+	u8 percent;
+	mutex_lock(&data->mutex);
+	if (data->manual)
+		percent = data->manual_percent;
+	else if (data->percent_prev >= 0)
+		percent = data->percent_prev;
+	else
+		percent = 0;
+	mutex_unlock(&data->mutex);
+	return percent;
+}
+
+/**
+ * Moves the percent towards target as far as the limits allow.  Returns NULL,
+ * or why the percent must not change yet.
+ */
+static const char *percent_data_limit(struct percent_data *data, u8 target,
+                                      ktime_t now, u8 *percent)
+{
+	const struct percent_limits *limits = &data->limits;
+	ktime_t slewing;
+	s64 elapsed_ms, step;
+	*percent = target;
+	if (data->percent_prev < 0)
+		return NULL;
+
+	elapsed_ms = ktime_ms_delta(now, data->changed);
+	if (elapsed_ms < limits->hold_ms)
+		return "hold";
+	if (limits->slew == 0)
+		return NULL;
+	// a long steady period must not turn into one big step
+	slewing = ktime_after(data->settled, data->changed) ? data->settled
+	                                                    : data->changed;
+	step = div_s64(ktime_ms_delta(now, slewing) * limits->slew,
+	               MSEC_PER_SEC);
+	if (step == 0)
+		return "slew";
+	if (target > data->percent_prev + step)
+		*percent = data->percent_prev + step;
+	else if (target < data->percent_prev - step)
+		*percent = data->percent_prev - step;
+	return NULL;
+}
+
 int kraken_x62_update_percent(struct usb_kraken *kraken,
                               struct percent_data *data)
 {
-	struct percent_msg *msg;
+	const ktime_t now = ktime_get();
+	const char *limit;
 	s8 value;
+	u8 target, percent;
 	int ret = 0;
 	mutex_lock(&data->mutex);
 	if (!data->update)
 		goto error;
+	if (data->manual) {
+		// the limits only apply to following the curve
+		value = -1;
+		target = percent = data->manual_percent;
+		if (percent == data->percent_prev) {
+			transfer_skip(&data->transfer, "message");
+			goto error;
+		}
+		goto send;
+	}
 
-	value = data->value.get(data->value.state, kraken->data);
+	value = dynamic_val_get(&data->value, kraken->data);
 	if (value < 0) {
 		dev_err(&kraken->udev->dev,
 		        "error getting value for dynamic percent update: %d\n",
@@ -156,18 +289,56 @@ int kraken_x62_update_percent(struct usb_kraken *kraken,
 		ret = value;
 		goto error;
 	}
-	if (value == data->value_prev)
+	if (data->mode == PERCENT_MODE_PID) {
+		// evaluated on every update, since its state changes with time
+		target = percent_pid_eval(&data->pid, value, now,
+		                          data->percent_min, data->percent_max);
+		goto evaluated;
+	}
+	// value_prev is -1 while slewing, so these two skips find the percent at
+	// its target
+	if (value == data->value_prev) {
+		data->settled = now;
+		transfer_skip(&data->transfer, "value");
 		goto error;
-	msg = &data->msgs[value];
-	if (data->msg_prev != NULL &&
-	    memcmp(msg, data->msg_prev, sizeof(*msg)) == 0)
+	}
+	if (data->value_prev >= 0 &&
+	    abs(value - data->value_prev) < data->limits.hysteresis) {
+		data->settled = now;
+		transfer_skip(&data->transfer, "hysteresis");
 		goto error;
+	}
+	target = percent_curve_eval(&data->curve, value);
 
-	ret = percent_msg_update(msg, kraken);
-	if (ret)
+evaluated:
+	if (target == data->percent_prev) {
+		data->value_prev = value;
+		data->settled = now;
+		transfer_skip(&data->transfer, "message");
+		goto error;
+	}
+	limit = percent_data_limit(data, target, now, &percent);
+	if (limit != NULL) {
+		transfer_skip(&data->transfer, limit);
+		goto error;
+	}
+
+send:
+	percent_msg_set(&data->msg, percent);
+	ret = percent_msg_update(&data->msg, &data->transfer);
+	if (ret) {
+		// previous message still in flight: retry on the next update
+		if (ret == -EBUSY)
+			ret = 0;
 		goto error;
-	data->value_prev = value;
-	data->msg_prev = msg;
+	}
+	// while slewing, the curve is followed again on the next update
+	data->value_prev = percent == target ? value : -1;
+	data->percent_prev = percent;
+	data->changed = now;
+	if (percent != data->applied)
+		kraken_netlink_duty(kraken, data->transfer.name, percent);
+	WRITE_ONCE(data->applied, percent);
 
 error:
 	mutex_unlock(&data->mutex);
@@ -199,14 +370,17 @@ static int percent_parser_percent(struct percent_parser *parser, u8 *percent)
 	return 0;
 }
 
-static int percent_parser_silent(struct percent_parser *parser)
+static int percent_parser_silent(struct percent_parser *parser,
+                                  struct percent_curve *curve)
 {
-	switch (percent_msg_which_get(&parser->data->msgs[0])) {
+	switch (parser->data->which) {
 	case PERCENT_MSG_WHICH_FAN:
-		percent_data_set(parser->data, PERCENTS_SILENT_FAN);
+		percent_curve_set(curve, POINTS_SILENT_FAN,
+		                  ARRAY_SIZE(POINTS_SILENT_FAN));
 		break;
 	case PERCENT_MSG_WHICH_PUMP:
-		percent_data_set(parser->data, PERCENTS_SILENT_PUMP);
+		percent_curve_set(curve, POINTS_SILENT_PUMP,
+		                  ARRAY_SIZE(POINTS_SILENT_PUMP));
 		break;
 	}
 	return 0;
@@ -215,15 +389,15 @@ static int percent_parser_silent(struct percent_parser *parser)
 #define PERCENTS_FIXED_MAX_FAN  ((u8) 50)
 #define PERCENTS_FIXED_MAX_PUMP ((u8) 50)
 
-static int percent_parser_fixed(struct percent_parser *parser)
+static int percent_parser_fixed(struct percent_parser *parser,
+                                 struct percent_curve *curve)
 {
-	size_t i;
 	u8 max, percent;
 	int ret = percent_parser_percent(parser, &percent);
 	if (ret)
 		return ret;
 
-	switch (percent_msg_which_get(&parser->data->msgs[0])) {
+	switch (parser->data->which) {
 	case PERCENT_MSG_WHICH_FAN:
 		max = PERCENTS_FIXED_MAX_FAN;
 		break;
@@ -232,54 +406,170 @@ static int percent_parser_fixed(struct percent_parser *parser)
 		break;
 	}
 
-	for (i = 0; i < max; i++)
-		percent_msg_set(&parser->data->msgs[i], percent);
-	for (i = max; i < ARRAY_SIZE(parser->data->msgs); i++)
-		percent_msg_set(&parser->data->msgs[i],
-		                parser->data->percent_min);
+	// a step from percent to percent_min between max - 1 and max
+	curve->len = 3;
+	curve->points[0] = (struct percent_point) { 0, percent };
+	curve->points[1] = (struct percent_point) { max - 1, percent };
+	curve->points[2]
+		= (struct percent_point) { max, parser->data->percent_min };
 	return 0;
 }
 
-static int percent_parser_performance(struct percent_parser *parser)
+static int percent_parser_performance(struct percent_parser *parser,
+                                       struct percent_curve *curve)
 {
-	switch (percent_msg_which_get(&parser->data->msgs[0])) {
+	switch (parser->data->which) {
 	case PERCENT_MSG_WHICH_FAN:
-		percent_data_set(parser->data, PERCENTS_PERFORMANCE_FAN);
+		percent_curve_set(curve, POINTS_PERFORMANCE_FAN,
+		                  ARRAY_SIZE(POINTS_PERFORMANCE_FAN));
 		break;
 	case PERCENT_MSG_WHICH_PUMP:
-		percent_data_set(parser->data, PERCENTS_PERFORMANCE_PUMP);
+		percent_curve_set(curve, POINTS_PERFORMANCE_PUMP,
+		                  ARRAY_SIZE(POINTS_PERFORMANCE_PUMP));
 		break;
 	}
 	return 0;
 }
 
-static int percent_parser_custom(struct percent_parser *parser)
+static int percent_parser_custom(struct percent_parser *parser,
+                                  struct percent_curve *curve)
 {
-	size_t i;
-	for (i = 0; i < ARRAY_SIZE(parser->data->msgs); i++) {
-		u8 percent;
-		int ret = percent_parser_percent(parser, &percent);
+	struct percent_point point;
+	curve->len = 0;
+	for (point.value = 0; point.value <= DYNAMIC_VAL_MAX; point.value++) {
+		int ret = percent_parser_percent(parser, &point.percent);
+		if (ret)
+			return ret;
+		percent_curve_append(curve, point);
+	}
+	return 0;
+}
+
+static int percent_parser_curve(struct percent_parser *parser,
+                                struct percent_curve *curve)
+{
+	char value_str[WORD_LEN_MAX + 1];
+	struct percent_point point;
+	unsigned int value_ui;
+	int ret;
+	const char *buf = parser->buf;
+	curve->len = 0;
+	while (!str_scan_word(&parser->buf, value_str)) {
+		// the points end at the first word that isn't a number, which
+		// is left for the options
+		if (kstrtouint(value_str, 0, &value_ui)) {
+			parser->buf = buf;
+			break;
+		}
+		if (value_ui > DYNAMIC_VAL_MAX ||
+		    (curve->len > 0 &&
+		     value_ui <= curve->points[curve->len - 1].value)) {
+			dev_warn(parser->dev, "%s: invalid curve value %s\n",
+			         parser->attr, value_str);
+			return -EINVAL;
+		}
+		point.value = value_ui;
+		ret = percent_parser_percent(parser, &point.percent);
 		if (ret)
 			return ret;
-		percent_msg_set(&parser->data->msgs[i], percent);
+		percent_curve_append(curve, point);
+		buf = parser->buf;
 	}
+	if (curve->len == 0) {
+		dev_warn(parser->dev, "%s: missing curve points\n",
+		         parser->attr);
+		return 1;
+	}
+	return 0;
+}
+
+static int percent_parser_limits(struct percent_parser *parser,
+                                 struct percent_limits *limits)
+{
+	char name[WORD_LEN_MAX + 1];
+	char value_str[WORD_LEN_MAX + 1];
+	unsigned int value;
+	int ret;
+	memset(limits, 0, sizeof(*limits));
+	while (!str_scan_word(&parser->buf, name)) {
+		ret = str_scan_word(&parser->buf, value_str);
+		if (ret) {
+			dev_warn(parser->dev, "%s: missing value of %s\n",
+			         parser->attr, name);
+			return ret;
+		}
+		ret = kstrtouint(value_str, 0, &value);
+		if (ret) {
+			dev_warn(parser->dev, "%s: invalid value of %s: %s\n",
+			         parser->attr, name, value_str);
+			return ret;
+		}
+		if (strcasecmp(name, "hysteresis") == 0) {
+			limits->hysteresis = min_t(unsigned int, value,
+			                           DYNAMIC_VAL_MAX);
+		} else if (strcasecmp(name, "hold") == 0) {
+			limits->hold_ms = value;
+		} else if (strcasecmp(name, "slew") == 0) {
+			limits->slew = value;
+		} else {
+			dev_warn(parser->dev, "%s: invalid option %s\n",
+			         parser->attr, name);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int percent_parser_milli(struct percent_parser *parser,
+                                const char *name, s32 min, s32 max,
+                                s32 *milli)
+{
+	char milli_str[WORD_LEN_MAX + 1];
+	int ret = str_scan_word(&parser->buf, milli_str);
+	if (ret) {
+		dev_warn(parser->dev, "%s: missing %s\n", parser->attr, name);
+		return ret;
+	}
+	ret = str_parse_milli(milli_str, milli);
+	if (!ret && (*milli < min || *milli > max))
+		ret = -ERANGE;
+	if (ret)
+		dev_warn(parser->dev, "%s: invalid %s %s\n", parser->attr, name,
+		         milli_str);
+	return ret;
+}
+
+static int percent_parser_pid(struct percent_parser *parser,
+                              struct percent_pid *pid)
+{
+	const s32 setpoint_max = DYNAMIC_VAL_MAX * 1000;
+	int ret;
+	if ((ret = percent_parser_milli(parser, "setpoint", 0, setpoint_max,
+	                                &pid->setpoint)) ||
+	    (ret = percent_parser_milli(parser, "kp", -PERCENT_PID_GAIN_MAX,
+	                                PERCENT_PID_GAIN_MAX, &pid->kp)) ||
+	    (ret = percent_parser_milli(parser, "ki", -PERCENT_PID_GAIN_MAX,
+	                                PERCENT_PID_GAIN_MAX, &pid->ki)) ||
+	    (ret = percent_parser_milli(parser, "kd", -PERCENT_PID_GAIN_MAX,
+	                                PERCENT_PID_GAIN_MAX, &pid->kd)))
+		return ret;
+	percent_pid_reset(pid, parser->data->percent_min);
 	return 0;
 }
 
 int percent_parser_parse(struct percent_parser *parser)
 {
+	// only replace the current ones once complete
+	enum percent_mode mode = PERCENT_MODE_CURVE;
+	struct percent_curve curve;
+	struct percent_pid pid;
+	struct percent_limits limits;
+	struct dynamic_val value;
 	char type[WORD_LEN_MAX + 1];
-	char *source = type;
-	int ret = str_scan_word(&parser->buf, source);
-	if (ret || strcasecmp(source, "temp_liquid") != 0) {
-		// NOTE: currently only temp_liquid is implemented as a source
-		dev_warn(parser->dev, "%s: missing dynamic value source\n",
-		         parser->attr);
-		if (!ret)
-			ret = 1;
+	int ret = dynamic_val_parse(&value, &parser->buf, parser->dev,
+	                            parser->attr);
+	if (ret)
 		goto error;
-	}
-	parser->data->value.get = dynamic_val_temp_liquid;
 
 	ret = str_scan_word(&parser->buf, type);
 	if (ret) {
@@ -288,13 +578,18 @@ int percent_parser_parse(struct percent_parser *parser)
 		goto error;
 	}
 	if (strcasecmp(type, "silent") == 0) {
-		ret = percent_parser_silent(parser);
+		ret = percent_parser_silent(parser, &curve);
 	} else if (strcasecmp(type, "fixed") == 0) {
-		ret = percent_parser_fixed(parser);
+		ret = percent_parser_fixed(parser, &curve);
 	} else if (strcasecmp(type, "performance") == 0) {
-		ret = percent_parser_performance(parser);
+		ret = percent_parser_performance(parser, &curve);
 	} else if (strcasecmp(type, "custom") == 0) {
-		ret = percent_parser_custom(parser);
+		ret = percent_parser_custom(parser, &curve);
+	} else if (strcasecmp(type, "curve") == 0) {
+		ret = percent_parser_curve(parser, &curve);
+	} else if (strcasecmp(type, "pid") == 0) {
+		mode = PERCENT_MODE_PID;
+		ret = percent_parser_pid(parser, &pid);
 	} else {
 		dev_warn(parser->dev, "%s: invalid percent type %s\n",
 		         parser->attr, type);
@@ -303,18 +598,21 @@ int percent_parser_parse(struct percent_parser *parser)
 	}
 	if (ret)
 		goto error;
-	ret = str_scan_word(&parser->buf, type);
-	if (!ret) {
-		dev_warn(parser->dev,
-		         "%s: unrecognized data left in buffer: %s...\n",
-		         parser->attr, type);
-		ret = 1;
+	ret = percent_parser_limits(parser, &limits);
+	if (ret)
 		goto error;
-	}
 
+	parser->data->value = value;
+	parser->data->mode = mode;
+	if (mode == PERCENT_MODE_PID)
+		parser->data->pid = pid;
+	else
+		parser->data->curve = curve;
+	parser->data->limits = limits;
 	parser->data->value_prev = -1;
-	parser->data->msg_prev = NULL;
+	parser->data->percent_prev = -1;
 	parser->data->update = true;
+	parser->data->manual = false;
 	return 0;
 
 error:
@@ -2,8 +2,10 @@
 #define LEVIATHAN_X62_PERCENT_H_INCLUDED
 
 #include "dynamic.h"
+#include "transfer.h"
 #include "../common.h"
 
+#include <linux/ktime.h>
 #include <linux/mutex.h>
 
 #define PERCENT_MSG_SIZE ((size_t) 5)
@@ -17,23 +19,151 @@ enum percent_msg_which {
 	PERCENT_MSG_WHICH_PUMP = 0x40,
 };
 
+/**
+ * A curve has at most one point per dynamic value.
+ */
+#define PERCENT_CURVE_POINTS_MAX ((size_t) DYNAMIC_VAL_MAX + 1)
+
+struct percent_point {
+	u8 value;
+	u8 percent;
+};
+
+/**
+ * A piecewise-linear mapping from dynamic values to percents, through points
+ * of strictly increasing values.  Values before the first point map to its
+ * percent, and values after the last point to its percent.
+ */
+struct percent_curve {
+	u8 len;
+	struct percent_point points[PERCENT_CURVE_POINTS_MAX];
+};
+
+/**
+ * Limits on how often and how fast the percent follows the curve; 0 disables
+ * a limit.
+ * @hysteresis: the value must move at least this much from the value the
+ *              percent was last set for before it is set again
+ * @hold_ms: the percent is kept at least this long after each change
+ * @slew: the percent changes by at most this much per second
+ */
+struct percent_limits {
+	u8 hysteresis;
+	unsigned int hold_ms;
+	unsigned int slew;
+};
+
+/**
+ * A PID controller driving the value to a setpoint, all in thousandths of the
+ * units of the value, the percent and seconds.
+ * @setpoint: the value to hold
+ * @kp: percent per unit of value above the setpoint
+ * @ki: percent per unit of value above the setpoint per second
+ * @kd: percent per unit of value per second the value rises at
+ */
+struct percent_pid {
+	s32 setpoint;
+	s32 kp;
+	s32 ki;
+	s32 kd;
+	// the integral term, kept within percent_min – percent_max
+	s64 integral;
+	s64 error_prev;
+	// when the controller was last evaluated; ktime_set(0, 0) if never
+	ktime_t evaluated;
+};
+
+/**
+ * Evaluations further apart than this count as this far apart, so that a long
+ * pause cannot swing the integral.
+ */
+#define PERCENT_PID_DT_MAX_MS 10000
+
+/**
+ * The gains must be within ±this, in thousandths, i.e. ±1000.000, which keeps
+ * the controller's 64-bit arithmetic from overflowing.
+ */
+#define PERCENT_PID_GAIN_MAX 1000000
+
+enum percent_mode {
+	// the percent follows the curve
+	PERCENT_MODE_CURVE,
+	// the percent is set by the PID controller
+	PERCENT_MODE_PID,
+};
+
 struct percent_data {
 	u8 percent_min;
 	u8 percent_max;
+	enum percent_msg_which which;
 
 	bool update;
 	// called by the update function
 	struct dynamic_val value;
-	// msgs[val] is the message to send for value val
-	struct percent_msg msgs[DYNAMIC_VAL_MAX + 1];
+	enum percent_mode mode;
+	// the percent to send for each value
+	struct percent_curve curve;
+	struct percent_pid pid;
+	struct percent_limits limits;
+	// value the curve was last followed for, or -1 if the percent has yet to
+	// reach the curve
 	s8 value_prev;
-	struct percent_msg *msg_prev;
+	// percent of the last message sent, or -1 to send the next one
+	// regardless
+	s16 percent_prev;
+	// when the last message was sent
+	ktime_t changed;
+	// when the percent was last found at its target; slewing towards a new
+	// one starts from then rather than from the last change
+	ktime_t settled;
+	// if true, manual_percent is sent instead of following the curve
+	bool manual;
+	u8 manual_percent;
+	// the message sent, with the percent of the update
+	struct percent_msg msg;
+	// percent of the last message submitted, or 0 if none was; read with
+	// percent_data_applied()
+	u8 applied;
 
+	struct transfer transfer;
 	struct mutex mutex;
 };
 
 void percent_data_init(struct percent_data *data, enum percent_msg_which which);
 
+/**
+ * Forgets the previously sent message so that the next update sends one
+ * regardless.
+ */
+void percent_data_invalidate(struct percent_data *data);
+
+/**
+ * Switches to a fixed percent, clamped to percent_min – percent_max, regardless
+ * of the dynamic value.
+ */
+void percent_data_set_manual(struct percent_data *data, u8 percent);
+
+/**
+ * Switches back to following the dynamic value, as last parsed.
+ */
+void percent_data_set_auto(struct percent_data *data);
+
+bool percent_data_manual(struct percent_data *data);
+
+/**
+ * The percent last submitted to the device.  Safe to call in interrupt
+ * context.
+ */
+static inline u8 percent_data_applied(struct percent_data *data)
+{
+	return READ_ONCE(data->applied);
+}
+
+/**
+ * The manual percent, or else the percent last sent, or 0 if none was.
+ */
+u8 percent_data_percent(struct percent_data *data);
+
 int kraken_x62_update_percent(struct usb_kraken *kraken,
                               struct percent_data *data);
 
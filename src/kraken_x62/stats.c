@@ -0,0 +1,131 @@
+/* Rolling statistics of the status fields.
+ */
+
+#include "stats.h"
+
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+
+/**
+ * Width of the histogram bins of each field; samples past the last bin are
+ * counted in it.
+ */
+static const u32 STATS_BIN_WIDTHS[STATS_FIELDS_SIZE] = {
+	[STATS_FIELD_TEMP_LIQUID] = 1,
+	[STATS_FIELD_FAN_RPM]     = 64,
+	[STATS_FIELD_PUMP_RPM]    = 64,
+};
+
+static const unsigned int STATS_WINDOW_MINUTES[STATS_WINDOWS_SIZE] = {
+	[STATS_WINDOW_1M]  = 1,
+	[STATS_WINDOW_5M]  = 5,
+	[STATS_WINDOW_15M] = 15,
+};
+
+static s64 stats_slot(ktime_t time)
+{
+	return ktime_divns(time, STATS_BUCKET_SECONDS * NSEC_PER_SEC);
+}
+
+void stats_data_init(struct stats_data *data)
+{
+	size_t field, i;
+	spin_lock_init(&data->lock);
+	memset(data->buckets, 0, sizeof(data->buckets));
+	for (field = 0; field < STATS_FIELDS_SIZE; field++)
+		for (i = 0; i < STATS_BUCKETS; i++)
+			data->buckets[field][i].slot = -1;
+}
+
+static void stats_bucket_add(struct stats_bucket *bucket, s64 slot,
+                             u32 width, u32 sample)
+{
+	if (bucket->slot != slot) {
+		memset(bucket, 0, sizeof(*bucket));
+		bucket->slot = slot;
+		bucket->min = sample;
+		bucket->max = sample;
+	}
+	bucket->count++;
+	bucket->sum += sample;
+	bucket->min = min(bucket->min, sample);
+	bucket->max = max(bucket->max, sample);
+	bucket->bins[min_t(u32, sample / width, STATS_BINS - 1)]++;
+}
+
+void stats_data_add(struct stats_data *data, ktime_t captured,
+                    const u32 samples[STATS_FIELDS_SIZE])
+{
+	const s64 slot = stats_slot(captured);
+	size_t field;
+	u32 i;
+	unsigned long flags;
+	div_u64_rem(slot, STATS_BUCKETS, &i);
+	spin_lock_irqsave(&data->lock, flags);
+	for (field = 0; field < STATS_FIELDS_SIZE; field++)
+		stats_bucket_add(&data->buckets[field][i], slot,
+		                 STATS_BIN_WIDTHS[field], samples[field]);
+	spin_unlock_irqrestore(&data->lock, flags);
+}
+
+int stats_data_get(struct stats_data *data, enum stats_field field,
+                   enum stats_window window, enum stats_value value, u32 *out)
+{
+	const s64 now = stats_slot(ktime_get());
+	const s64 first = now - STATS_WINDOW_MINUTES[window] * 60 /
+	                        STATS_BUCKET_SECONDS;
+	const u32 width = STATS_BIN_WIDTHS[field];
+	struct stats_bucket total = { .min = U32_MAX, };
+	u32 rank, seen;
+	size_t i, bin;
+	unsigned long flags;
+
+	spin_lock_irqsave(&data->lock, flags);
+	for (i = 0; i < STATS_BUCKETS; i++) {
+		const struct stats_bucket *bucket = &data->buckets[field][i];
+		if (bucket->slot < first || bucket->slot > now)
+			continue;
+		total.count += bucket->count;
+		total.sum += bucket->sum;
+		total.min = min(total.min, bucket->min);
+		total.max = max(total.max, bucket->max);
+		// only needed for percentiles, and there are many buckets
+		if (value != STATS_VALUE_P95)
+			continue;
+		for (bin = 0; bin < STATS_BINS; bin++)
+			total.bins[bin] += bucket->bins[bin];
+	}
+	spin_unlock_irqrestore(&data->lock, flags);
+
+	if (total.count == 0)
+		return -ENODATA;
+	switch (value) {
+	case STATS_VALUE_MIN:
+		*out = total.min;
+		break;
+	case STATS_VALUE_MAX:
+		*out = total.max;
+		break;
+	case STATS_VALUE_MEAN:
+		*out = div_u64(total.sum, total.count);
+		break;
+	case STATS_VALUE_P95:
+		// the rank is the count times 95%, rounded up; report the upper
+		// edge of the bin holding the sample of that rank
+		rank = total.count - total.count / 20;
+		seen = 0;
+		for (bin = 0; bin < STATS_BINS - 1; bin++) {
+			seen += total.bins[bin];
+			if (seen >= rank)
+				break;
+		}
+		*out = clamp((u32) (bin + 1) * width - 1, total.min, total.max);
+		break;
+	default:
+		return -EINVAL;
+	}
+	return 0;
+}
@@ -0,0 +1,95 @@
+#ifndef LEVIATHAN_X62_STATS_H_INCLUDED
+#define LEVIATHAN_X62_STATS_H_INCLUDED
+
+#include <linux/ktime.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+
+/**
+ * Samples are aggregated into one bucket per this many seconds.
+ */
+#define STATS_BUCKET_SECONDS 10
+
+/**
+ * Enough buckets are kept for the longest window of 15 minutes, plus the
+ * current one, which is only partly over.
+ */
+#define STATS_BUCKETS (15 * 60 / STATS_BUCKET_SECONDS + 1)
+
+/**
+ * Each bucket keeps a histogram of this many bins per field, from which
+ * percentiles are estimated.
+ */
+#define STATS_BINS 64
+
+/**
+ * The status fields aggregated.
+ */
+enum stats_field {
+	STATS_FIELD_TEMP_LIQUID,
+	STATS_FIELD_FAN_RPM,
+	STATS_FIELD_PUMP_RPM,
+
+	STATS_FIELDS_SIZE,
+};
+
+/**
+ * The windows aggregated over.  A window of n minutes trails now: it covers the
+ * current bucket and the n minutes of buckets before it, so that it spans at
+ * least n minutes and at most STATS_BUCKET_SECONDS more.
+ */
+enum stats_window {
+	STATS_WINDOW_1M,
+	STATS_WINDOW_5M,
+	STATS_WINDOW_15M,
+
+	STATS_WINDOWS_SIZE,
+};
+
+enum stats_value {
+	STATS_VALUE_MIN,
+	STATS_VALUE_MAX,
+	STATS_VALUE_MEAN,
+	STATS_VALUE_P95,
+
+	STATS_VALUES_SIZE,
+};
+
+/**
+ * The samples of a field received during STATS_BUCKET_SECONDS.
+ */
+struct stats_bucket {
+	// number of the bucket since boot the samples were received during, i.e.
+	// the uptime divided by STATS_BUCKET_SECONDS; -1 if none were
+	s64 slot;
+	u32 count;
+	u64 sum;
+	u32 min;
+	u32 max;
+	u32 bins[STATS_BINS];
+};
+
+struct stats_data {
+	// taken in the status transfer's completion handler
+	spinlock_t lock;
+	struct stats_bucket buckets[STATS_FIELDS_SIZE][STATS_BUCKETS];
+};
+
+void stats_data_init(struct stats_data *data);
+
+/**
+ * Adds a sample of each field, received at captured.  Takes constant time.
+ * Safe to call in interrupt context.
+ */
+void stats_data_add(struct stats_data *data, ktime_t captured,
+                    const u32 samples[STATS_FIELDS_SIZE]);
+
+/**
+ * Computes a value of a field over a window ending now.  Returns -ENODATA if
+ * no sample was received during the window.  Percentiles are estimated from
+ * the histograms, and never outside the range of the samples.
+ */
+int stats_data_get(struct stats_data *data, enum stats_field field,
+                   enum stats_window window, enum stats_value value, u32 *out);
+
+#endif  /* LEVIATHAN_X62_STATS_H_INCLUDED */
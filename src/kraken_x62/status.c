@@ -2,10 +2,17 @@
  */
 
 #include "status.h"
+#include "driver_data.h"
+#include "percent.h"
 #include "../common.h"
 
+#include <asm/unaligned.h>
+#include <linux/kernfs.h>
+#include <linux/ktime.h>
 #include <linux/printk.h>
+#include <linux/seqlock.h>
 #include <linux/string.h>
+#include <linux/sysfs.h>
 #include <linux/usb.h>
 
 static const u8 MSG_HEADER[] = {
@@ -19,113 +26,270 @@ static const u8 MSG_FOOTER_2S[][2] = {
 	{ 0x1e, 0x00, },
 };
 
+/**
+ * Fan and pump speeds jitter slightly between messages even when steady, so
+ * only changes of at least this many RPM count as changes.
+ */
+#define STATUS_RPM_CHANGE_MIN ((u16) 50)
+
+static const char *const STATUS_FIELD_NAMES[STATUS_FIELDS_SIZE] = {
+	[STATUS_FIELD_TEMP_LIQUID] = "temp_liquid",
+	[STATUS_FIELD_FAN_RPM]     = "fan_rpm",
+	[STATUS_FIELD_PUMP_RPM]    = "pump_rpm",
+	[STATUS_FIELD_UNKNOWN_1]   = "unknown_1",
+	[STATUS_FIELD_UNKNOWN_2]   = "unknown_2",
+	[STATUS_FIELD_FOOTER_2]    = "footer_2",
+	[STATUS_FIELD_ALL]         = "status",
+};
+
 void status_data_init(struct status_data *data)
 {
-	mutex_init(&data->mutex);
+	seqlock_init(&data->lock);
+	memset(data->msg, 0, sizeof(data->msg));
+	data->captured = ktime_set(0, 0);
+	data->stream = false;
+	memset(data->dirents, 0, sizeof(data->dirents));
+	data->temp_liquid_ref = 0;
+	data->fan_rpm_ref = 0;
+	data->pump_rpm_ref = 0;
+	stats_data_init(&data->stats);
 }
 
-u8 status_data_temp_liquid(struct status_data *data)
+void status_data_watch(struct status_data *data, struct kobject *kobj)
 {
-	u8 temp;
-	mutex_lock(&data->mutex);
-	temp = data->msg[1];
-	mutex_unlock(&data->mutex);
+	size_t i;
+	for (i = 0; i < STATUS_FIELDS_SIZE; i++)
+		WRITE_ONCE(data->dirents[i],
+		           sysfs_get_dirent(kobj->sd, STATUS_FIELD_NAMES[i]));
+}
 
-	return temp;
+void status_data_unwatch(struct status_data *data)
+{
+	size_t i;
+	for (i = 0; i < STATUS_FIELDS_SIZE; i++) {
+		sysfs_put(data->dirents[i]);
+		data->dirents[i] = NULL;
+	}
 }
 
-u16 status_data_fan_rpm(struct status_data *data)
+void status_data_get(struct status_data *data, u8 *msg, ktime_t *captured)
 {
-	u16 rpm_be;
-	mutex_lock(&data->mutex);
-	rpm_be = *((u16 *) (data->msg + 3));
-	mutex_unlock(&data->mutex);
+	unsigned int seq;
+	do {
+		seq = read_seqbegin(&data->lock);
+		memcpy(msg, data->msg, sizeof(data->msg));
+		if (captured != NULL)
+			*captured = data->captured;
+	} while (read_seqretry(&data->lock, seq));
+}
 
-	return be16_to_cpu(rpm_be);
+u8 status_msg_temp_liquid(const u8 *msg)
+{
+	return msg[1];
 }
 
-u16 status_data_pump_rpm(struct status_data *data)
+u16 status_msg_fan_rpm(const u8 *msg)
 {
-	u16 rpm_be;
-	mutex_lock(&data->mutex);
-	rpm_be = *((u16 *) (data->msg + 5));
-	mutex_unlock(&data->mutex);
+	return get_unaligned_be16(msg + 3);
+}
 
-	return be16_to_cpu(rpm_be);
+u16 status_msg_pump_rpm(const u8 *msg)
+{
+	return get_unaligned_be16(msg + 5);
 }
 
 // TODO figure out what this is
-u8 status_data_unknown_1(struct status_data *data)
+u8 status_msg_unknown_1(const u8 *msg)
 {
-	u8 unknown_1;
-	mutex_lock(&data->mutex);
-	unknown_1 = data->msg[2];
-	mutex_unlock(&data->mutex);
-
-	return unknown_1;
+	return msg[2];
 }
 
 // TODO figure out what this is
-u32 status_data_unknown_2(struct status_data *data)
+u32 status_msg_unknown_2(const u8 *msg)
 {
-	u32 unknown_2_be;
-	mutex_lock(&data->mutex);
-	unknown_2_be = *((u32 *) (data->msg + 7));
-	mutex_unlock(&data->mutex);
-
-	return be32_to_cpu(unknown_2_be);
+	return get_unaligned_be32(msg + 7);
 }
 
 // TODO figure out what this means
-u16 status_data_footer_2(struct status_data *data)
+u16 status_msg_footer_2(const u8 *msg)
 {
-	u16 footer_2_be;
-	mutex_lock(&data->mutex);
-	footer_2_be = *((u16 *) (data->msg + 15));
-	mutex_unlock(&data->mutex);
+	return get_unaligned_be16(msg + 15);
+}
 
-	return be16_to_cpu(footer_2_be);
+u8 status_data_temp_liquid(struct status_data *data)
+{
+	u8 msg[STATUS_DATA_MSG_SIZE];
+	status_data_get(data, msg, NULL);
+	return status_msg_temp_liquid(msg);
 }
 
-int kraken_x62_update_status(struct usb_kraken *kraken,
-                             struct status_data *data)
+u16 status_data_fan_rpm(struct status_data *data)
 {
-	bool invalid;
-	int received;
-	int ret;
-	mutex_lock(&data->mutex);
-	ret = usb_interrupt_msg(kraken->udev, usb_rcvctrlpipe(kraken->udev, 1),
-	                        data->msg, sizeof(data->msg), &received, 1000);
-	mutex_unlock(&data->mutex);
+	u8 msg[STATUS_DATA_MSG_SIZE];
+	status_data_get(data, msg, NULL);
+	return status_msg_fan_rpm(msg);
+}
 
-	if (ret || received != sizeof(data->msg)) {
-		dev_err(&kraken->udev->dev,
-		        "failed status update: I/O error\n");
-		return ret ? ret : 1;
+u16 status_data_pump_rpm(struct status_data *data)
+{
+	u8 msg[STATUS_DATA_MSG_SIZE];
+	status_data_get(data, msg, NULL);
+	return status_msg_pump_rpm(msg);
+}
+
+u8 status_data_unknown_1(struct status_data *data)
+{
+	u8 msg[STATUS_DATA_MSG_SIZE];
+	status_data_get(data, msg, NULL);
+	return status_msg_unknown_1(msg);
+}
+
+u32 status_data_unknown_2(struct status_data *data)
+{
+	u8 msg[STATUS_DATA_MSG_SIZE];
+	status_data_get(data, msg, NULL);
+	return status_msg_unknown_2(msg);
+}
+
+u16 status_data_footer_2(struct status_data *data)
+{
+	u8 msg[STATUS_DATA_MSG_SIZE];
+	status_data_get(data, msg, NULL);
+	return status_msg_footer_2(msg);
+}
+
+static u32 status_msg_field(const u8 *msg, enum status_field field)
+{
+	switch (field) {
+	case STATUS_FIELD_TEMP_LIQUID:
+		return status_msg_temp_liquid(msg);
+	case STATUS_FIELD_FAN_RPM:
+		return status_msg_fan_rpm(msg);
+	case STATUS_FIELD_PUMP_RPM:
+		return status_msg_pump_rpm(msg);
+	case STATUS_FIELD_UNKNOWN_1:
+		return status_msg_unknown_1(msg);
+	case STATUS_FIELD_UNKNOWN_2:
+		return status_msg_unknown_2(msg);
+	case STATUS_FIELD_FOOTER_2:
+		return status_msg_footer_2(msg);
+	default:
+		return 0;
+	}
+}
+
+/**
+ * Notifies the files of the fields that differ between the messages.  Uses
+ * kernfs_notify() rather than sysfs_notify(), since it is safe in interrupt
+ * context.
+ */
+static void status_data_notify(struct status_data *data, const u8 *msg_old,
+                               const u8 *msg)
+{
+	struct kernfs_node *dirent;
+	bool changed = false;
+	enum status_field field;
+	for (field = 0; field < STATUS_FIELD_ALL; field++) {
+		if (status_msg_field(msg_old, field) ==
+		    status_msg_field(msg, field))
+			continue;
+		changed = true;
+		dirent = READ_ONCE(data->dirents[field]);
+		if (dirent != NULL)
+			kernfs_notify(dirent);
 	}
+	dirent = READ_ONCE(data->dirents[STATUS_FIELD_ALL]);
+	if (changed && dirent != NULL)
+		kernfs_notify(dirent);
+}
+
+static bool status_rpm_changed(u16 *ref, u16 rpm)
+{
+	const u16 diff = (rpm > *ref) ? rpm - *ref : *ref - rpm;
+	if (diff < STATUS_RPM_CHANGE_MIN)
+		return false;
+	*ref = rpm;
+	return true;
+}
+
+int status_data_receive(struct status_data *data, struct usb_kraken *kraken,
+                        const u8 *msg)
+{
+	struct device *dev = &kraken->udev->dev;
+	struct kraken_status status;
+	u8 msg_old[STATUS_DATA_MSG_SIZE];
+	u32 samples[STATS_FIELDS_SIZE];
+	unsigned long flags;
+	bool changed = false;
 	// check header & footer 1
-	invalid = false;
-	if (memcmp(data->msg + 0, MSG_HEADER, sizeof(MSG_HEADER)) != 0 ||
-	    memcmp(data->msg + 11, MSG_FOOTER_1, sizeof(MSG_FOOTER_1)) != 0)
+	bool invalid = false;
+	if (memcmp(msg + 0, MSG_HEADER, sizeof(MSG_HEADER)) != 0 ||
+	    memcmp(msg + 11, MSG_FOOTER_1, sizeof(MSG_FOOTER_1)) != 0)
 		invalid = true;
 	if (!invalid) {
 		// check all footer 2s
 		size_t i;
 		invalid = true;
 		for (i = 0; i < ARRAY_SIZE(MSG_FOOTER_2S); i++)
-			if (memcmp(data->msg + 15, MSG_FOOTER_2S[i],
+			if (memcmp(msg + 15, MSG_FOOTER_2S[i],
 			           sizeof(MSG_FOOTER_2S[i])) == 0) {
 				invalid = false;
 				break;
 			}
 	}
 	if (invalid) {
-		char status_hex[sizeof(data->msg) * 3 + 1];
-		hex_dump_to_buffer(data->msg, sizeof(data->msg), 32, 1,
+		char status_hex[STATUS_DATA_MSG_SIZE * 3 + 1];
+		hex_dump_to_buffer(msg, STATUS_DATA_MSG_SIZE, 32, 1,
 		                   status_hex, sizeof(status_hex), false);
-		dev_err(&kraken->udev->dev,
-		        "received invalid status message: %s\n", status_hex);
-		return 1;
+		dev_err(dev, "received invalid status message: %s\n",
+		        status_hex);
+		return -EIO;
 	}
+
+	status.captured = ktime_get();
+	status.temp_liquid = status_msg_temp_liquid(msg);
+	status.fan_rpm = status_msg_fan_rpm(msg);
+	status.pump_rpm = status_msg_pump_rpm(msg);
+	status.fan_percent = percent_data_applied(&kraken->data->percent_fan);
+	status.pump_percent = percent_data_applied(&kraken->data->percent_pump);
+
+	write_seqlock_irqsave(&data->lock, flags);
+	memcpy(msg_old, data->msg, sizeof(msg_old));
+	memcpy(data->msg, msg, sizeof(data->msg));
+	data->captured = status.captured;
+	write_sequnlock_irqrestore(&data->lock, flags);
+	kraken_status_publish(kraken, &status, msg, STATUS_DATA_MSG_SIZE);
+	status_data_notify(data, msg_old, msg);
+
+	samples[STATS_FIELD_TEMP_LIQUID] = status.temp_liquid;
+	samples[STATS_FIELD_FAN_RPM] = status.fan_rpm;
+	samples[STATS_FIELD_PUMP_RPM] = status.pump_rpm;
+	stats_data_add(&data->stats, status.captured, samples);
+
+	// NOTE: only the completion handler of the status transfer gets here, so
+	// the references need no lock
+	if (status.temp_liquid != data->temp_liquid_ref) {
+		data->temp_liquid_ref = status.temp_liquid;
+		changed = true;
+	}
+	// NOTE: bitwise or, so that both references are updated
+	changed |= status_rpm_changed(&data->fan_rpm_ref, status.fan_rpm) |
+	           status_rpm_changed(&data->pump_rpm_ref, status.pump_rpm);
+
+	if (changed)
+		kraken_update_changed(kraken);
 	return 0;
 }
+
+int kraken_x62_update_status(struct usb_kraken *kraken,
+                             struct status_data *data)
+{
+	int ret = transfer_submit(&data->transfer, NULL, sizeof(data->msg));
+	// previous request still in flight: its reply will do
+	if (ret == -EBUSY)
+		return 0;
+	if (ret)
+		dev_err(&kraken->udev->dev,
+		        "failed status update: %d\n", ret);
+	return ret;
+}
@@ -1,19 +1,97 @@
 #ifndef LEVIATHAN_X62_STATUS_H_INCLUDED
 #define LEVIATHAN_X62_STATUS_H_INCLUDED
 
+#include "stats.h"
+#include "transfer.h"
 #include "../common.h"
 
-#include <linux/mutex.h>
+#include <linux/kernfs.h>
+#include <linux/kobject.h>
+#include <linux/ktime.h>
+#include <linux/seqlock.h>
 
 #define STATUS_DATA_MSG_SIZE ((size_t) 17)
 
+/**
+ * The decoded fields of a status message, each with an attribute of the same
+ * name.
+ */
+enum status_field {
+	STATUS_FIELD_TEMP_LIQUID,
+	STATUS_FIELD_FAN_RPM,
+	STATUS_FIELD_PUMP_RPM,
+	STATUS_FIELD_UNKNOWN_1,
+	STATUS_FIELD_UNKNOWN_2,
+	STATUS_FIELD_FOOTER_2,
+	// the status attribute, which changes whenever any other field does
+	STATUS_FIELD_ALL,
+
+	STATUS_FIELDS_SIZE,
+};
+
 struct status_data {
+	// the last valid message and when it was received; it is stored from the
+	// transfer's completion handler, and read under the seqlock so that
+	// readers never block and always see a whole message
+	seqlock_t lock;
 	u8 msg[STATUS_DATA_MSG_SIZE];
-	struct mutex mutex;
+	ktime_t captured;
+	// receives status messages; its buffer is only copied to msg once the
+	// message has been checked
+	struct transfer transfer;
+	// if true, the transfer is re-armed as soon as a message arrives instead
+	// of being submitted once per update
+	bool stream;
+	// the attributes' files, notified when their field changes; NULL if not
+	// watched
+	struct kernfs_node *dirents[STATUS_FIELDS_SIZE];
+	// readings as of the last message that changed them noticeably
+	u8 temp_liquid_ref;
+	u16 fan_rpm_ref;
+	u16 pump_rpm_ref;
+	// aggregates of the fields over the last minutes
+	struct stats_data stats;
 };
 
+/**
+ * Layout of the status_raw attribute: the last valid message, prefixed by the
+ * CLOCK_MONOTONIC time in nanoseconds it was received at, in host byte order.
+ */
+struct status_raw {
+	s64 captured_ns;
+	u8 msg[STATUS_DATA_MSG_SIZE];
+} __packed;
+
 void status_data_init(struct status_data *data);
 
+/**
+ * Looks up the attributes' files under kobj, so that status_data_receive()
+ * notifies pollers of a file whenever its field changes.  Call
+ * status_data_unwatch() once no more messages can be received.
+ */
+void status_data_watch(struct status_data *data, struct kobject *kobj);
+void status_data_unwatch(struct status_data *data);
+
+/**
+ * Copies the last valid message into msg, which must have room for
+ * STATUS_DATA_MSG_SIZE bytes, and the time it was received into *captured
+ * unless NULL.  The time is ktime_set(0, 0) if no message has been received.
+ */
+void status_data_get(struct status_data *data, u8 *msg, ktime_t *captured);
+
+/**
+ * Decode the fields of a message copied by status_data_get().
+ */
+u8 status_msg_temp_liquid(const u8 *msg);
+u16 status_msg_fan_rpm(const u8 *msg);
+u16 status_msg_pump_rpm(const u8 *msg);
+u8 status_msg_unknown_1(const u8 *msg);
+u32 status_msg_unknown_2(const u8 *msg);
+u16 status_msg_footer_2(const u8 *msg);
+
+/**
+ * Return a single field of the last valid message.
+ */
 u8 status_data_temp_liquid(struct status_data *data);
 u16 status_data_fan_rpm(struct status_data *data);
 u16 status_data_pump_rpm(struct status_data *data);
@@ -21,6 +99,18 @@ u8 status_data_unknown_1(struct status_data *data);
 u32 status_data_unknown_2(struct status_data *data);
 u16 status_data_footer_2(struct status_data *data);
 
+/**
+ * Checks a received status message and stores it if valid, also publishing it
+ * with kraken_status_publish().  Safe to call in interrupt context.
+ */
+int status_data_receive(struct status_data *data, struct usb_kraken *kraken,
+                        const u8 *msg);
+
+/**
+ * Requests a status message from the device without waiting for it, unless a
+ * request is already in flight.  Once it arrives, the status transfer's
+ * complete function is called.
+ */
 int kraken_x62_update_status(struct usb_kraken *kraken,
                              struct status_data *data);
 
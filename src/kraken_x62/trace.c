@@ -0,0 +1,5 @@
+/* Definitions of the trace events.
+ */
+
+#define CREATE_TRACE_POINTS
+#include "trace.h"
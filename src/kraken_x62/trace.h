@@ -0,0 +1,119 @@
+/* Trace events of the update loop and its transfers.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM kraken_x62
+
+#if !defined(LEVIATHAN_X62_TRACE_H_INCLUDED) || defined(TRACE_HEADER_MULTI_READ)
+#define LEVIATHAN_X62_TRACE_H_INCLUDED
+
+#include <linux/device.h>
+#include <linux/tracepoint.h>
+#include <linux/types.h>
+
+TRACE_EVENT(kraken_x62_update_start,
+	TP_PROTO(struct device *dev),
+	TP_ARGS(dev),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(dev))
+	),
+	TP_fast_assign(
+		__assign_str(dev, dev_name(dev));
+	),
+	TP_printk("%s", __get_str(dev))
+);
+
+TRACE_EVENT(kraken_x62_update_end,
+	TP_PROTO(struct device *dev, int ret, s64 duration_ns),
+	TP_ARGS(dev, ret, duration_ns),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(dev))
+		__field(int, ret)
+		__field(s64, duration_ns)
+	),
+	TP_fast_assign(
+		__assign_str(dev, dev_name(dev));
+		__entry->ret = ret;
+		__entry->duration_ns = duration_ns;
+	),
+	TP_printk("%s ret=%d duration_ns=%lld", __get_str(dev), __entry->ret,
+	          __entry->duration_ns)
+);
+
+/**
+ * A transfer was submitted; ret is the result of the submission, not of the
+ * transfer.
+ */
+TRACE_EVENT(kraken_x62_transfer_submit,
+	TP_PROTO(struct device *dev, const char *name, size_t len, int ret),
+	TP_ARGS(dev, name, len, ret),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(dev))
+		__string(name, name)
+		__field(size_t, len)
+		__field(int, ret)
+	),
+	TP_fast_assign(
+		__assign_str(dev, dev_name(dev));
+		__assign_str(name, name);
+		__entry->len = len;
+		__entry->ret = ret;
+	),
+	TP_printk("%s %s len=%zu ret=%d", __get_str(dev), __get_str(name),
+	          __entry->len, __entry->ret)
+);
+
+/**
+ * A transfer completed, successfully or not, duration_ns after its
+ * submission.
+ */
+TRACE_EVENT(kraken_x62_transfer_complete,
+	TP_PROTO(struct device *dev, const char *name, size_t len, int ret,
+	         s64 duration_ns),
+	TP_ARGS(dev, name, len, ret, duration_ns),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(dev))
+		__string(name, name)
+		__field(size_t, len)
+		__field(int, ret)
+		__field(s64, duration_ns)
+	),
+	TP_fast_assign(
+		__assign_str(dev, dev_name(dev));
+		__assign_str(name, name);
+		__entry->len = len;
+		__entry->ret = ret;
+		__entry->duration_ns = duration_ns;
+	),
+	TP_printk("%s %s len=%zu ret=%d duration_ns=%lld", __get_str(dev),
+	          __get_str(name), __entry->len, __entry->ret,
+	          __entry->duration_ns)
+);
+
+/**
+ * An update of a channel sent nothing, see transfer_skip() for why.
+ */
+TRACE_EVENT(kraken_x62_update_skip,
+	TP_PROTO(struct device *dev, const char *name, const char *why),
+	TP_ARGS(dev, name, why),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(dev))
+		__string(name, name)
+		__string(why, why)
+	),
+	TP_fast_assign(
+		__assign_str(dev, dev_name(dev));
+		__assign_str(name, name);
+		__assign_str(why, why);
+	),
+	TP_printk("%s %s skipped: %s", __get_str(dev), __get_str(name),
+	          __get_str(why))
+);
+
+#endif  /* LEVIATHAN_X62_TRACE_H_INCLUDED */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE trace
+#include <trace/define_trace.h>
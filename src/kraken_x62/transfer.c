@@ -0,0 +1,233 @@
+/* Asynchronous interrupt transfers.
+ */
+
+#include "trace.h"
+#include "transfer.h"
+#include "../common.h"
+
+#include <linux/atomic.h>
+#include <linux/jiffies.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/seq_file.h>
+#include <linux/string.h>
+#include <linux/usb.h>
+
+void transfer_stats_init(struct transfer_stats *stats)
+{
+	size_t i;
+	atomic_set(&stats->transfers, 0);
+	atomic64_set(&stats->bytes, 0);
+	atomic_set(&stats->skips, 0);
+	for (i = 0; i < ARRAY_SIZE(stats->errors); i++)
+		atomic_set(&stats->errors[i], 0);
+	kraken_histogram_init(&stats->latency);
+}
+
+void transfer_stats_show(struct seq_file *seq, struct transfer_stats *stats)
+{
+	size_t i;
+	seq_printf(seq, "  transfers %u\n", atomic_read(&stats->transfers));
+	seq_printf(seq, "  bytes %lld\n",
+	           (long long) atomic64_read(&stats->bytes));
+	seq_printf(seq, "  skips %u\n", atomic_read(&stats->skips));
+	seq_puts(seq, "  errors");
+	for (i = 1; i < ARRAY_SIZE(stats->errors); i++) {
+		const unsigned int count = atomic_read(&stats->errors[i]);
+		if (count)
+			seq_printf(seq, " -%zu %u", i, count);
+	}
+	if (atomic_read(&stats->errors[0]))
+		seq_printf(seq, " other %u", atomic_read(&stats->errors[0]));
+	seq_puts(seq, "\n  latency_us\n");
+	kraken_histogram_show(seq, &stats->latency);
+}
+
+static void transfer_stats_error(struct transfer *transfer, int error)
+{
+	if (transfer->stats == NULL)
+		return;
+	if (error < 0 && -error <= TRANSFER_STATS_ERRNO_MAX)
+		atomic_inc(&transfer->stats->errors[-error]);
+	else
+		atomic_inc(&transfer->stats->errors[0]);
+}
+
+void transfer_data_init(struct transfer_data *data, struct usb_kraken *kraken)
+{
+	data->kraken = kraken;
+	init_usb_anchor(&data->anchor);
+	INIT_LIST_HEAD(&data->transfers);
+}
+
+static void transfer_fail(struct transfer *transfer, int error)
+{
+	transfer_stats_error(transfer, error);
+	if (transfer->error != NULL)
+		atomic_cmpxchg(transfer->error, 0, error);
+}
+
+int transfer_data_expire(struct transfer_data *data)
+{
+	struct transfer *transfer;
+	int ret = 0;
+	list_for_each_entry(transfer, &data->transfers, node) {
+		const unsigned long deadline
+			= READ_ONCE(transfer->submitted) + TRANSFER_TIMEOUT;
+		if (!atomic_read(&transfer->busy) ||
+		    READ_ONCE(transfer->untimed) ||
+		    time_before_eq(jiffies, deadline))
+			continue;
+		usb_unlink_urb(transfer->urb);
+		transfer_fail(transfer, -ETIMEDOUT);
+		ret = -ETIMEDOUT;
+	}
+	if (ret)
+		dev_err(&data->kraken->udev->dev, "transfers timed out\n");
+	return ret;
+}
+
+void transfer_data_kill(struct transfer_data *data)
+{
+	usb_kill_anchored_urbs(&data->anchor);
+}
+
+void transfer_data_stop(struct transfer_data *data)
+{
+	usb_poison_anchored_urbs(&data->anchor);
+}
+
+static void transfer_complete(struct urb *urb)
+{
+	struct transfer *transfer = urb->context;
+	const ktime_t duration = ktime_sub(ktime_get(), transfer->submitted_time);
+	int ret = urb->status;
+	if (!ret && urb->actual_length != urb->transfer_buffer_length)
+		ret = -EIO;
+	trace_kraken_x62_transfer_complete(&transfer->data->kraken->udev->dev,
+	                                   transfer->name, urb->actual_length,
+	                                   ret, ktime_to_ns(duration));
+	if (transfer->stats != NULL) {
+		kraken_histogram_add(&transfer->stats->latency, duration);
+		if (!ret) {
+			atomic_inc(&transfer->stats->transfers);
+			atomic64_add(urb->actual_length,
+			             &transfer->stats->bytes);
+		}
+	}
+
+	atomic_set(&transfer->busy, 0);
+	switch (ret) {
+	case 0:
+		if (transfer->complete != NULL)
+			transfer->complete(transfer);
+		break;
+	// killed, unlinked, or device gone: not a transfer error
+	case -ENOENT:
+	case -ECONNRESET:
+	case -ESHUTDOWN:
+	case -EPERM:
+		break;
+	default:
+		dev_err_ratelimited(&transfer->data->kraken->udev->dev,
+		                    "failed transfer on endpoint %#02x: %d\n",
+		                    usb_pipeendpoint(urb->pipe) |
+		                    (usb_pipein(urb->pipe) ? USB_DIR_IN : 0),
+		                    ret);
+		transfer_fail(transfer, ret);
+		break;
+	}
+}
+
+int transfer_init(struct transfer *transfer, struct transfer_data *data,
+                  unsigned int pipe, size_t size)
+{
+	struct usb_device *udev = data->kraken->udev;
+	struct usb_host_endpoint *ep = usb_pipe_endpoint(udev, pipe);
+	if (ep == NULL)
+		return -ENODEV;
+
+	transfer->data = data;
+	transfer->size = size;
+	transfer->name = "transfer";
+	transfer->error = NULL;
+	transfer->stats = NULL;
+	transfer->untimed = false;
+	atomic_set(&transfer->busy, 0);
+	transfer->urb = usb_alloc_urb(0, GFP_KERNEL);
+	if (transfer->urb == NULL)
+		goto error_urb;
+	transfer->buf = usb_alloc_coherent(udev, size, GFP_KERNEL,
+	                                   &transfer->urb->transfer_dma);
+	if (transfer->buf == NULL)
+		goto error_buf;
+
+	usb_fill_int_urb(transfer->urb, udev, pipe, transfer->buf, size,
+	                 transfer_complete, transfer, ep->desc.bInterval);
+	transfer->urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+	list_add_tail(&transfer->node, &data->transfers);
+	return 0;
+error_buf:
+	usb_free_urb(transfer->urb);
+	transfer->urb = NULL;
+error_urb:
+	return -ENOMEM;
+}
+
+void transfer_free(struct transfer *transfer)
+{
+	if (transfer->urb == NULL)
+		return;
+	list_del(&transfer->node);
+	usb_free_coherent(transfer->data->kraken->udev, transfer->size,
+	                  transfer->buf, transfer->urb->transfer_dma);
+	transfer->buf = NULL;
+	usb_free_urb(transfer->urb);
+	transfer->urb = NULL;
+}
+
+static int transfer_submit_flags(struct transfer *transfer, const u8 *msg,
+                                 size_t len, gfp_t flags)
+{
+	int ret;
+	if (len > transfer->size)
+		return -EINVAL;
+	if (atomic_cmpxchg(&transfer->busy, 0, 1) != 0)
+		return -EBUSY;
+
+	if (msg != NULL)
+		memcpy(transfer->buf, msg, len);
+	transfer->urb->transfer_buffer_length = len;
+	WRITE_ONCE(transfer->submitted, jiffies);
+	transfer->submitted_time = ktime_get();
+	usb_anchor_urb(transfer->urb, &transfer->data->anchor);
+	ret = usb_submit_urb(transfer->urb, flags);
+	if (ret) {
+		usb_unanchor_urb(transfer->urb);
+		atomic_set(&transfer->busy, 0);
+		transfer_stats_error(transfer, ret);
+	}
+	trace_kraken_x62_transfer_submit(&transfer->data->kraken->udev->dev,
+	                                 transfer->name, len, ret);
+	return ret;
+}
+
+int transfer_submit(struct transfer *transfer, const u8 *msg, size_t len)
+{
+	return transfer_submit_flags(transfer, msg, len, GFP_KERNEL);
+}
+
+int transfer_resubmit(struct transfer *transfer)
+{
+	return transfer_submit_flags(transfer, NULL,
+	                             transfer->urb->transfer_buffer_length,
+	                             GFP_ATOMIC);
+}
+
+void transfer_skip(struct transfer *transfer, const char *why)
+{
+	trace_kraken_x62_update_skip(&transfer->data->kraken->udev->dev,
+	                             transfer->name, why);
+	if (transfer->stats != NULL)
+		atomic_inc(&transfer->stats->skips);
+}
@@ -0,0 +1,142 @@
+#ifndef LEVIATHAN_X62_TRANSFER_H_INCLUDED
+#define LEVIATHAN_X62_TRANSFER_H_INCLUDED
+
+#include "../common.h"
+#include "../histogram.h"
+
+#include <linux/atomic.h>
+#include <linux/jiffies.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/seq_file.h>
+#include <linux/usb.h>
+
+/**
+ * Transfers that are still in flight after this long are unlinked by
+ * transfer_data_expire().
+ */
+#define TRANSFER_TIMEOUT (msecs_to_jiffies(1000))
+
+/**
+ * Errnos up to this are counted separately by transfer_stats.
+ */
+#define TRANSFER_STATS_ERRNO_MAX 127
+
+/**
+ * Counters of transfers, which may be shared by several of them.
+ */
+struct transfer_stats {
+	// successful transfers and their bytes
+	atomic_t transfers;
+	atomic64_t bytes;
+	// updates that sent nothing, see transfer_skip()
+	atomic_t skips;
+	// errors[e] counts failures with errno e, and errors[0] those with larger
+	// errnos
+	atomic_t errors[TRANSFER_STATS_ERRNO_MAX + 1];
+	// time from submission to completion, whether successful or not
+	struct kraken_histogram latency;
+};
+
+void transfer_stats_init(struct transfer_stats *stats);
+
+/**
+ * Prints the counters, the errors as "-<errno> <count>" pairs.
+ */
+void transfer_stats_show(struct seq_file *seq, struct transfer_stats *stats);
+
+struct transfer_data;
+
+/**
+ * A pre-allocated interrupt URB together with its DMA-coherent transfer buffer.
+ * At most one message can be in flight per transfer.
+ */
+struct transfer {
+	struct transfer_data *data;
+	struct list_head node;
+	struct urb *urb;
+	u8 *buf;
+	size_t size;
+	// names the transfer in trace events
+	const char *name;
+	// non-0 while the URB is submitted
+	atomic_t busy;
+	// jiffies at the last submission
+	unsigned long submitted;
+	// ktime_get() at the last submission, for tracing the transfer's duration
+	ktime_t submitted_time;
+	// if true, the transfer waits for whenever the device next reports, so
+	// transfer_data_expire() leaves it in flight
+	bool untimed;
+	// called from the completion handler (i.e. in interrupt context) after a
+	// successful transfer; may be NULL
+	void (*complete)(struct transfer *transfer);
+	void *context;
+	// if not NULL, the first error of a failed transfer is stored here until
+	// its owner collects it
+	atomic_t *error;
+	// if not NULL, the transfer is counted here
+	struct transfer_stats *stats;
+};
+
+/**
+ * State shared by all transfers of a device.
+ */
+struct transfer_data {
+	struct usb_kraken *kraken;
+	struct usb_anchor anchor;
+	// all initialized transfers; only modified while probing
+	struct list_head transfers;
+};
+
+void transfer_data_init(struct transfer_data *data, struct usb_kraken *kraken);
+
+/**
+ * Unlinks without waiting all transfers other than untimed ones that have been
+ * in flight for longer than TRANSFER_TIMEOUT, stores -ETIMEDOUT as their error,
+ * and returns -ETIMEDOUT if there were any.
+ */
+int transfer_data_expire(struct transfer_data *data);
+
+/**
+ * Cancels all transfers in flight and waits for their completion handlers to
+ * finish.  Further submissions still succeed.
+ */
+void transfer_data_kill(struct transfer_data *data);
+
+/**
+ * Cancels all transfers in flight and makes any further submission fail.  Waits
+ * for the completion handlers to finish.
+ */
+void transfer_data_stop(struct transfer_data *data);
+
+/**
+ * Allocates the transfer's URB and buffer of the given size for the interrupt
+ * endpoint of pipe.  transfer_free() may be called on a transfer that has been
+ * zeroed but not initialized.
+ */
+int transfer_init(struct transfer *transfer, struct transfer_data *data,
+                  unsigned int pipe, size_t size);
+void transfer_free(struct transfer *transfer);
+
+/**
+ * Submits the transfer without waiting for it to complete.  For an OUT transfer
+ * msg is copied into the transfer buffer; for an IN transfer msg must be NULL.
+ * Returns -EBUSY if the transfer's previous message is still in flight.
+ */
+int transfer_submit(struct transfer *transfer, const u8 *msg, size_t len);
+
+/**
+ * Submits the transfer again with the same length.  Meant to re-arm an IN
+ * transfer from its complete function, so safe to call in interrupt context.
+ */
+int transfer_resubmit(struct transfer *transfer);
+
+/**
+ * Records that an update of the transfer's owner sent nothing.  why is "value"
+ * if the value is the same as the last one sent, "message" if only the message
+ * is, or names the limit that held the message back, e.g. "hold".
+ */
+void transfer_skip(struct transfer *transfer, const char *why);
+
+#endif  /* LEVIATHAN_X62_TRANSFER_H_INCLUDED */
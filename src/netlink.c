@@ -0,0 +1,121 @@
+/* Implementation of the generic netlink family.
+ */
+
+#include "netlink.h"
+#include "common.h"
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/string.h>
+#include <net/genetlink.h>
+#include <net/netlink.h>
+
+static const struct genl_multicast_group kraken_netlink_mcgrps[] = {
+	{ .name = KRAKEN_NL_MCGRP_EVENTS, },
+};
+
+// NOTE: named at registration, since this file is linked into several modules
+static struct genl_family kraken_netlink_family = {
+	.version  = KRAKEN_NL_VERSION,
+	.maxattr  = KRAKEN_NL_ATTR_MAX,
+	.module   = THIS_MODULE,
+	.mcgrps   = kraken_netlink_mcgrps,
+	.n_mcgrps = ARRAY_SIZE(kraken_netlink_mcgrps),
+};
+
+int kraken_netlink_init(void)
+{
+	strscpy(kraken_netlink_family.name, kraken_driver_name,
+	        sizeof(kraken_netlink_family.name));
+	return genl_register_family(&kraken_netlink_family);
+}
+
+void kraken_netlink_exit(void)
+{
+	genl_unregister_family(&kraken_netlink_family);
+}
+
+/**
+ * Starts an event of the device, or returns NULL if no one listens or it could
+ * not be allocated.
+ */
+static struct sk_buff *kraken_netlink_start(struct usb_kraken *kraken, u8 cmd,
+                                            void **hdr)
+{
+	struct sk_buff *skb;
+	if (!genl_has_listeners(&kraken_netlink_family, &init_net, 0))
+		return NULL;
+	skb = genlmsg_new(NLMSG_GOODSIZE, GFP_ATOMIC);
+	if (skb == NULL)
+		return NULL;
+	*hdr = genlmsg_put(skb, 0, 0, &kraken_netlink_family, 0, cmd);
+	if (*hdr == NULL ||
+	    nla_put_string(skb, KRAKEN_NL_ATTR_DEVICE,
+	                   dev_name(&kraken->interface->dev))) {
+		nlmsg_free(skb);
+		return NULL;
+	}
+	return skb;
+}
+
+static void kraken_netlink_send(struct sk_buff *skb, void *hdr)
+{
+	genlmsg_end(skb, hdr);
+	genlmsg_multicast(&kraken_netlink_family, skb, 0, 0, GFP_ATOMIC);
+}
+
+void kraken_netlink_status(struct usb_kraken *kraken,
+                           const struct kraken_status *status)
+{
+	void *hdr;
+	struct sk_buff *skb
+		= kraken_netlink_start(kraken, KRAKEN_NL_CMD_STATUS, &hdr);
+	if (skb == NULL)
+		return;
+	if (nla_put_s64(skb, KRAKEN_NL_ATTR_CAPTURED_NS,
+	                ktime_to_ns(status->captured), KRAKEN_NL_ATTR_PAD) ||
+	    nla_put_u8(skb, KRAKEN_NL_ATTR_TEMP_LIQUID, status->temp_liquid) ||
+	    nla_put_u16(skb, KRAKEN_NL_ATTR_FAN_RPM, status->fan_rpm) ||
+	    nla_put_u16(skb, KRAKEN_NL_ATTR_PUMP_RPM, status->pump_rpm) ||
+	    nla_put_u8(skb, KRAKEN_NL_ATTR_FAN_PERCENT, status->fan_percent) ||
+	    nla_put_u8(skb, KRAKEN_NL_ATTR_PUMP_PERCENT, status->pump_percent))
+		goto error;
+	kraken_netlink_send(skb, hdr);
+	return;
+error:
+	nlmsg_free(skb);
+}
+
+void kraken_netlink_duty(struct usb_kraken *kraken, const char *channel,
+                         u8 percent)
+{
+	void *hdr;
+	struct sk_buff *skb
+		= kraken_netlink_start(kraken, KRAKEN_NL_CMD_DUTY, &hdr);
+	if (skb == NULL)
+		return;
+	if (nla_put_string(skb, KRAKEN_NL_ATTR_CHANNEL, channel) ||
+	    nla_put_u8(skb, KRAKEN_NL_ATTR_PERCENT, percent))
+		goto error;
+	kraken_netlink_send(skb, hdr);
+	return;
+error:
+	nlmsg_free(skb);
+}
+
+void kraken_netlink_error(struct usb_kraken *kraken, int error,
+                          unsigned int retries)
+{
+	void *hdr;
+	struct sk_buff *skb
+		= kraken_netlink_start(kraken, KRAKEN_NL_CMD_ERROR, &hdr);
+	if (skb == NULL)
+		return;
+	if (nla_put_s32(skb, KRAKEN_NL_ATTR_ERROR, error) ||
+	    nla_put_u32(skb, KRAKEN_NL_ATTR_RETRIES, retries))
+		goto error;
+	kraken_netlink_send(skb, hdr);
+	return;
+error:
+	nlmsg_free(skb);
+}
@@ -0,0 +1,74 @@
+/* Generic netlink family multicasting the devices' events.
+ */
+
+#ifndef LEVIATHAN_NETLINK_H_INCLUDED
+#define LEVIATHAN_NETLINK_H_INCLUDED
+
+#include "common.h"
+
+#include <linux/types.h>
+
+/**
+ * The family is named after the driver, and has a single multicast group of
+ * this name.
+ */
+#define KRAKEN_NL_VERSION 1
+#define KRAKEN_NL_MCGRP_EVENTS "events"
+
+/**
+ * The events, each a message of this command.
+ * @KRAKEN_NL_CMD_STATUS: a status was received; has all status attributes
+ * @KRAKEN_NL_CMD_DUTY: a new duty cycle was applied; has CHANNEL and PERCENT
+ * @KRAKEN_NL_CMD_ERROR: an update failed; has ERROR and RETRIES
+ */
+enum kraken_nl_cmd {
+	KRAKEN_NL_CMD_UNSPEC,
+	KRAKEN_NL_CMD_STATUS,
+	KRAKEN_NL_CMD_DUTY,
+	KRAKEN_NL_CMD_ERROR,
+
+	__KRAKEN_NL_CMD_MAX,
+};
+
+/**
+ * The attributes of the events.  Every event has DEVICE, the name of the
+ * device's USB interface.
+ */
+enum kraken_nl_attr {
+	KRAKEN_NL_ATTR_UNSPEC,
+	KRAKEN_NL_ATTR_DEVICE,        // string
+	KRAKEN_NL_ATTR_CAPTURED_NS,   // s64, CLOCK_MONOTONIC
+	KRAKEN_NL_ATTR_TEMP_LIQUID,   // u8, °C
+	KRAKEN_NL_ATTR_FAN_RPM,       // u16
+	KRAKEN_NL_ATTR_PUMP_RPM,      // u16
+	KRAKEN_NL_ATTR_FAN_PERCENT,   // u8
+	KRAKEN_NL_ATTR_PUMP_PERCENT,  // u8
+	KRAKEN_NL_ATTR_CHANNEL,       // string, "fan" or "pump"
+	KRAKEN_NL_ATTR_PERCENT,       // u8
+	KRAKEN_NL_ATTR_ERROR,         // s32, negative errno
+	KRAKEN_NL_ATTR_RETRIES,       // u32, consecutive failed updates
+	KRAKEN_NL_ATTR_PAD,
+
+	__KRAKEN_NL_ATTR_MAX,
+};
+
+#define KRAKEN_NL_ATTR_MAX (__KRAKEN_NL_ATTR_MAX - 1)
+
+/**
+ * Registers the family.  Called once when the driver is registered.
+ */
+int kraken_netlink_init(void);
+void kraken_netlink_exit(void);
+
+/**
+ * Multicast an event, unless no one listens.  Safe to call in interrupt
+ * context; events that cannot be allocated are dropped.
+ */
+void kraken_netlink_status(struct usb_kraken *kraken,
+                           const struct kraken_status *status);
+void kraken_netlink_duty(struct usb_kraken *kraken, const char *channel,
+                         u8 percent);
+void kraken_netlink_error(struct usb_kraken *kraken, int error,
+                          unsigned int retries);
+
+#endif  /* LEVIATHAN_NETLINK_H_INCLUDED */
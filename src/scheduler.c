@@ -0,0 +1,369 @@
+/* Implementation of the driver-wide update scheduler.
+ */
+
+#include "scheduler.h"
+#include "common.h"
+#include "netlink.h"
+
+#include <linux/debugfs.h>
+#include <linux/hrtimer.h>
+#include <linux/idr.h>
+#include <linux/jiffies.h>
+#include <linux/list.h>
+#include <linux/math64.h>
+#include <linux/seq_file.h>
+#include <linux/spinlock.h>
+#include <linux/usb.h>
+#include <linux/workqueue.h>
+
+/**
+ * State shared by all devices bound by the driver.
+ */
+struct kraken_scheduler {
+	// protects devices and the update_interval and update_next of each device
+	spinlock_t lock;
+	struct list_head devices;
+	// the devices' slot numbers; the lowest free one is assigned on probe
+	struct ida slots;
+	// times the updates of devices with precise timers
+	struct hrtimer timer;
+	// times the updates of devices with deferrable timers
+	struct delayed_work timer_work;
+	// runs update_work and update_kick_work of all devices
+	struct workqueue_struct *workqueue;
+	struct dentry *debugfs;
+};
+
+static struct kraken_scheduler scheduler;
+
+static bool kraken_scheduler_halted(struct usb_kraken *kraken)
+{
+	return ktime_compare(kraken->update_interval, ktime_set(0, 0)) == 0;
+}
+
+/**
+ * The device's offset from the start of its interval, based on its slot.
+ */
+static ktime_t kraken_scheduler_stagger(struct usb_kraken *kraken)
+{
+	u64 offset;
+	if (kraken_scheduler_halted(kraken))
+		return ktime_set(0, 0);
+	div64_u64_rem((u64) kraken->update_slot
+	              * ktime_to_ns(SCHEDULER_STAGGER),
+	              ktime_to_ns(kraken->update_interval), &offset);
+	return ns_to_ktime(offset);
+}
+
+/**
+ * Schedules the device's first update after update_interval, staggered by its
+ * slot.  Called with the lock held.
+ */
+static void kraken_scheduler_start(struct usb_kraken *kraken, ktime_t now)
+{
+	kraken->update_next = ktime_add(ktime_add(now, kraken->update_interval),
+	                                kraken_scheduler_stagger(kraken));
+}
+
+static void kraken_scheduler_adapt(struct usb_kraken *kraken)
+{
+	ktime_t interval;
+	if (atomic_xchg(&kraken->update_changed, 0))
+		interval = kraken->update_interval_min;
+	else
+		interval = ktime_add(kraken->update_interval,
+		                     kraken->update_interval);
+	if (ktime_compare(interval, kraken->update_interval_max) > 0)
+		interval = kraken->update_interval_max;
+	if (ktime_compare(interval, kraken->update_interval_min) < 0)
+		interval = kraken->update_interval_min;
+	kraken->update_interval = interval;
+}
+
+/**
+ * Queues the device's update and schedules the next one.  Called with the lock
+ * held once the device's update is due.
+ */
+static void kraken_scheduler_service(struct usb_kraken *kraken, ktime_t now)
+{
+	ktime_t next;
+	if (!queue_work(scheduler.workqueue, &kraken->update_work)) {
+		atomic_inc(&kraken->update_overruns);
+		dev_warn(&kraken->udev->dev, "work already on a queue\n");
+	}
+	if (kraken->update_adaptive)
+		kraken_scheduler_adapt(kraken);
+	// the next update is timed from this one's deadline rather than from now,
+	// so that the device keeps its stagger
+	next = ktime_add(kraken->update_next, kraken->update_interval);
+	if (ktime_compare(next, now) <= 0)
+		next = ktime_add(now, kraken->update_interval);
+	kraken->update_next = next;
+}
+
+/**
+ * Services all devices whose update is due, whichever timer they are timed by,
+ * so that one expiry serves as many devices as possible.  Called with the lock
+ * held.
+ */
+static void kraken_scheduler_run(void)
+{
+	struct usb_kraken *kraken;
+	const ktime_t now = ktime_get();
+	list_for_each_entry(kraken, &scheduler.devices, update_node) {
+		if (kraken_scheduler_halted(kraken) ||
+		    ktime_compare(kraken->update_next, now) > 0)
+			continue;
+		kraken_scheduler_service(kraken, now);
+	}
+}
+
+static unsigned long kraken_scheduler_delay(struct usb_kraken *kraken,
+                                            ktime_t now)
+{
+	const s64 until_us = ktime_us_delta(kraken->update_next, now);
+	unsigned long delay = until_us > 0 ? usecs_to_jiffies(until_us) : 0;
+	const unsigned long slack = msecs_to_jiffies(kraken->update_slack_ms);
+	// align the expiry to a multiple of the slack, so that timers with the
+	// same slack expire together
+	if (slack > 1) {
+		const unsigned long rem = (jiffies + delay) % slack;
+		if (rem)
+			delay += slack - rem;
+	}
+	return delay;
+}
+
+/**
+ * (Re)programs each timer for the earliest update of the devices it times.  The
+ * precise timer may expire as late as the earliest deadline plus slack of
+ * these devices.  Called with the lock held.
+ */
+static void kraken_scheduler_program(void)
+{
+	struct usb_kraken *kraken;
+	struct usb_kraken *deferrable = NULL;
+	ktime_t soft = KTIME_MAX;
+	ktime_t hard = KTIME_MAX;
+	list_for_each_entry(kraken, &scheduler.devices, update_node) {
+		ktime_t latest;
+		if (kraken_scheduler_halted(kraken))
+			continue;
+		if (kraken->update_deferrable) {
+			if (deferrable == NULL ||
+			    ktime_before(kraken->update_next,
+			                 deferrable->update_next))
+				deferrable = kraken;
+			continue;
+		}
+		latest = ktime_add_ms(kraken->update_next,
+		                      kraken->update_slack_ms);
+		if (ktime_before(kraken->update_next, soft))
+			soft = kraken->update_next;
+		if (ktime_before(latest, hard))
+			hard = latest;
+	}
+
+	if (deferrable != NULL)
+		mod_delayed_work(system_power_efficient_wq,
+		                 &scheduler.timer_work,
+		                 kraken_scheduler_delay(deferrable, ktime_get()));
+	// NOTE: a timer that is left running with no device to time just expires
+	// without doing anything
+	if (ktime_compare(soft, KTIME_MAX) != 0)
+		hrtimer_start_range_ns(&scheduler.timer, soft,
+		                       ktime_to_ns(ktime_sub(hard, soft)),
+		                       HRTIMER_MODE_ABS);
+}
+
+static enum hrtimer_restart kraken_scheduler_timer(struct hrtimer *timer)
+{
+	unsigned long flags;
+	spin_lock_irqsave(&scheduler.lock, flags);
+	kraken_scheduler_run();
+	// restarts the timer itself if needed
+	kraken_scheduler_program();
+	spin_unlock_irqrestore(&scheduler.lock, flags);
+	return HRTIMER_NORESTART;
+}
+
+static void kraken_scheduler_timer_work(struct work_struct *timer_work)
+{
+	spin_lock_irq(&scheduler.lock);
+	kraken_scheduler_run();
+	kraken_scheduler_program();
+	spin_unlock_irq(&scheduler.lock);
+}
+
+int kraken_scheduler_add(struct usb_kraken *kraken)
+{
+	const ktime_t now = ktime_get();
+	int slot = ida_alloc(&scheduler.slots, GFP_KERNEL);
+	if (slot < 0)
+		return slot;
+	kraken->update_slot = slot;
+
+	spin_lock_irq(&scheduler.lock);
+	list_add_tail(&kraken->update_node, &scheduler.devices);
+	kraken_scheduler_start(kraken, now);
+	kraken_scheduler_program();
+	spin_unlock_irq(&scheduler.lock);
+	return 0;
+}
+
+void kraken_scheduler_remove(struct usb_kraken *kraken)
+{
+	spin_lock_irq(&scheduler.lock);
+	list_del(&kraken->update_node);
+	spin_unlock_irq(&scheduler.lock);
+
+	// the timers may have queued an update just before
+	cancel_work_sync(&kraken->update_work);
+	cancel_delayed_work_sync(&kraken->update_kick_work);
+	ida_free(&scheduler.slots, kraken->update_slot);
+}
+
+static ktime_t kraken_scheduler_backoff(struct usb_kraken *kraken)
+{
+	const unsigned int shift = min(kraken->update_retries, 8u);
+	const ktime_t backoff
+		= ns_to_ktime(ktime_to_ns(kraken->update_interval) << shift);
+	if (ktime_compare(backoff, SCHEDULER_BACKOFF_MAX) > 0)
+		return SCHEDULER_BACKOFF_MAX;
+	return backoff;
+}
+
+void kraken_scheduler_report(struct usb_kraken *kraken, int retval)
+{
+	ktime_t backoff;
+	bool reset = false;
+	unsigned int retries;
+	const ktime_t now = ktime_get();
+	spin_lock_irq(&scheduler.lock);
+	if (!retval) {
+		if (kraken->update_retries)
+			dev_info(&kraken->udev->dev,
+			         "updates recovered after %u failures\n",
+			         kraken->update_retries);
+		kraken->update_error = 0;
+		kraken->update_retries = 0;
+		goto out;
+	}
+
+	kraken->update_error = retval;
+	kraken->update_retries++;
+	retries = kraken->update_retries;
+	if (kraken_scheduler_halted(kraken))
+		goto out;
+	backoff = kraken_scheduler_backoff(kraken);
+	kraken->update_next = ktime_add(now, backoff);
+	kraken_scheduler_program();
+	reset = kraken->update_retries % SCHEDULER_RESET_RETRIES == 0;
+	dev_warn_ratelimited(&kraken->udev->dev,
+	                     "update failed: %d: retrying in %lld ms\n",
+	                     retval, ktime_to_ms(backoff));
+out:
+	spin_unlock_irq(&scheduler.lock);
+
+	if (retval)
+		kraken_netlink_error(kraken, retval, retries);
+	if (reset) {
+		dev_err(&kraken->udev->dev,
+		        "resetting device after %u failed updates\n", retries);
+		usb_queue_reset_device(kraken->interface);
+	}
+}
+
+void kraken_scheduler_set_interval(struct usb_kraken *kraken,
+                                   ktime_t interval)
+{
+	bool halted;
+	const ktime_t now = ktime_get();
+	spin_lock_irq(&scheduler.lock);
+	halted = kraken_scheduler_halted(kraken);
+	kraken->update_interval = interval;
+	// otherwise the new interval takes effect after the next update
+	if (halted && !kraken_scheduler_halted(kraken)) {
+		kraken_scheduler_start(kraken, now);
+		kraken_scheduler_program();
+	}
+	spin_unlock_irq(&scheduler.lock);
+}
+
+void kraken_scheduler_set_deferrable(struct usb_kraken *kraken,
+                                     bool deferrable)
+{
+	spin_lock_irq(&scheduler.lock);
+	kraken->update_deferrable = deferrable;
+	kraken_scheduler_program();
+	spin_unlock_irq(&scheduler.lock);
+}
+
+void kraken_scheduler_kick(struct usb_kraken *kraken, unsigned long delay)
+{
+	queue_delayed_work(scheduler.workqueue, &kraken->update_kick_work,
+	                   delay);
+}
+
+struct dentry *kraken_scheduler_debugfs(void)
+{
+	return scheduler.debugfs;
+}
+
+static int kraken_scheduler_show(struct seq_file *seq, void *unused)
+{
+	struct usb_kraken *kraken;
+	const ktime_t now = ktime_get();
+	seq_printf(seq, "%-16s %4s %8s %8s %8s %-10s %6s %7s\n", "device",
+	           "slot", "stagger", "interval", "next", "timer", "slack",
+	           "retries");
+
+	spin_lock_irq(&scheduler.lock);
+	list_for_each_entry(kraken, &scheduler.devices, update_node) {
+		const bool halted = kraken_scheduler_halted(kraken);
+		seq_printf(seq, "%-16s %4d %8lld %8lld %8lld %-10s %6u %7u\n",
+		           dev_name(&kraken->interface->dev), kraken->update_slot,
+		           ktime_to_ms(kraken_scheduler_stagger(kraken)),
+		           ktime_to_ms(kraken->update_interval),
+		           halted ? -1 : ktime_ms_delta(kraken->update_next, now),
+		           kraken->update_deferrable ? "deferrable" : "precise",
+		           kraken->update_slack_ms, kraken->update_retries);
+	}
+	spin_unlock_irq(&scheduler.lock);
+	return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(kraken_scheduler);
+
+int kraken_scheduler_init(void)
+{
+	spin_lock_init(&scheduler.lock);
+	INIT_LIST_HEAD(&scheduler.devices);
+	ida_init(&scheduler.slots);
+	hrtimer_init(&scheduler.timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	scheduler.timer.function = &kraken_scheduler_timer;
+	INIT_DEFERRABLE_WORK(&scheduler.timer_work,
+	                     &kraken_scheduler_timer_work);
+
+	// unbound, so that updates of different devices may run concurrently on
+	// whichever CPU is awake
+	scheduler.workqueue = alloc_workqueue("%s_up", WQ_UNBOUND, 0,
+	                                      kraken_driver_name);
+	if (scheduler.workqueue == NULL)
+		return -ENOMEM;
+
+	// debugfs is for diagnostics only, so failing to create it is not an error
+	scheduler.debugfs = debugfs_create_dir(kraken_driver_name, NULL);
+	debugfs_create_file("scheduler", 0444, scheduler.debugfs, NULL,
+	                    &kraken_scheduler_fops);
+	return 0;
+}
+
+void kraken_scheduler_exit(void)
+{
+	debugfs_remove_recursive(scheduler.debugfs);
+	hrtimer_cancel(&scheduler.timer);
+	cancel_delayed_work_sync(&scheduler.timer_work);
+	destroy_workqueue(scheduler.workqueue);
+	ida_destroy(&scheduler.slots);
+}
@@ -0,0 +1,85 @@
+/* Driver-wide update scheduler, servicing all bound devices from a single timer
+ * and workqueue.
+ */
+
+#ifndef LEVIATHAN_SCHEDULER_H_INCLUDED
+#define LEVIATHAN_SCHEDULER_H_INCLUDED
+
+#include "common.h"
+
+#include <linux/ktime.h>
+#include <linux/usb.h>
+
+/**
+ * Devices are staggered by this much times their slot number, so that the
+ * transfers of devices with the same interval don't collide on a shared host
+ * controller.
+ */
+#define SCHEDULER_STAGGER (ms_to_ktime(50))
+
+/**
+ * After a failed update, the next one is delayed by update_interval doubled
+ * once per consecutive failure, up to SCHEDULER_BACKOFF_MAX.
+ */
+#define SCHEDULER_BACKOFF_MAX (ms_to_ktime(30000))
+
+/**
+ * Every this many consecutive failed updates, the device is reset.
+ */
+#define SCHEDULER_RESET_RETRIES 3
+
+/**
+ * Sets up the scheduler.  Called once when the driver is registered, before any
+ * device is probed.
+ */
+int kraken_scheduler_init(void);
+
+/**
+ * Tears down the scheduler.  Called once when the driver is deregistered, after
+ * all devices have been disconnected.
+ */
+void kraken_scheduler_exit(void);
+
+/**
+ * Assigns the device a slot and starts scheduling its update_work.
+ */
+int kraken_scheduler_add(struct usb_kraken *kraken);
+
+/**
+ * Stops scheduling the device and waits for its update_work to finish.
+ */
+void kraken_scheduler_remove(struct usb_kraken *kraken);
+
+/**
+ * Sets the device's update interval.  A value of ktime_set(0, 0) halts its
+ * updates; setting a non-0 value while halted restarts them.
+ */
+void kraken_scheduler_set_interval(struct usb_kraken *kraken,
+                                   ktime_t interval);
+
+/**
+ * Selects the timer which the device's updates are timed by.
+ */
+void kraken_scheduler_set_deferrable(struct usb_kraken *kraken,
+                                     bool deferrable);
+
+/**
+ * Reports the result of an update.  After a failure, the next update is backed
+ * off and the device possibly reset; after a success, the device is considered
+ * recovered.
+ */
+void kraken_scheduler_report(struct usb_kraken *kraken, int retval);
+
+/**
+ * The driver's debugfs directory, under which each device has its own; an
+ * error pointer or NULL if debugfs is unavailable.
+ */
+struct dentry *kraken_scheduler_debugfs(void);
+
+/**
+ * Queues the device's update_kick_work after delay jiffies, unless already
+ * queued.
+ */
+void kraken_scheduler_kick(struct usb_kraken *kraken, unsigned long delay);
+
+#endif  /* LEVIATHAN_SCHEDULER_H_INCLUDED */
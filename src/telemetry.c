@@ -0,0 +1,331 @@
+/* Implementation of the telemetry device and its status page.
+ */
+
+#include "telemetry.h"
+#include "common.h"
+
+#include <linux/fs.h>
+#include <linux/idr.h>
+#include <linux/kref.h>
+#include <linux/list.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
+#include <linux/module.h>
+#include <linux/poll.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/uaccess.h>
+#include <linux/wait.h>
+
+/**
+ * The misc device of a device.  Open files may outlive the device, so it is
+ * reference counted.
+ */
+struct kraken_telemetry {
+	struct kref kref;
+	struct miscdevice misc;
+	char name[32];
+	int id;
+
+	// protects the readers, seq, disconnected and writing the page
+	spinlock_t lock;
+	struct list_head readers;
+	u32 seq;
+	bool disconnected;
+	wait_queue_head_t wait;
+
+	// the status page; mappings hold their own reference to it
+	struct page *page;
+	struct kraken_telemetry_page *status;
+};
+
+/**
+ * An open file of the misc device.
+ */
+struct kraken_telemetry_reader {
+	struct kraken_telemetry *telemetry;
+	struct list_head node;
+	// records[tail % TELEMETRY_RING_SIZE] is the oldest unread one, and
+	// head - tail the number of unread ones
+	unsigned int head;
+	unsigned int tail;
+	u32 dropped;
+	struct kraken_telemetry_record records[TELEMETRY_RING_SIZE];
+};
+
+static DEFINE_IDA(kraken_telemetry_ids);
+
+static void kraken_telemetry_release_kref(struct kref *kref)
+{
+	struct kraken_telemetry *telemetry
+		= container_of(kref, struct kraken_telemetry, kref);
+	ida_free(&kraken_telemetry_ids, telemetry->id);
+	__free_page(telemetry->page);
+	kfree(telemetry);
+}
+
+static int kraken_telemetry_open(struct inode *inode, struct file *file)
+{
+	// NOTE: the misc core holds its lock while calling this, so the device
+	// cannot be unregistered meanwhile
+	struct kraken_telemetry *telemetry = container_of(
+		file->private_data, struct kraken_telemetry, misc);
+	struct kraken_telemetry_reader *reader
+		= kzalloc(sizeof(*reader), GFP_KERNEL);
+	if (reader == NULL)
+		return -ENOMEM;
+	kref_get(&telemetry->kref);
+	reader->telemetry = telemetry;
+
+	spin_lock_irq(&telemetry->lock);
+	list_add_tail(&reader->node, &telemetry->readers);
+	spin_unlock_irq(&telemetry->lock);
+
+	file->private_data = reader;
+	return nonseekable_open(inode, file);
+}
+
+static int kraken_telemetry_release(struct inode *inode, struct file *file)
+{
+	struct kraken_telemetry_reader *reader = file->private_data;
+	struct kraken_telemetry *telemetry = reader->telemetry;
+
+	spin_lock_irq(&telemetry->lock);
+	list_del(&reader->node);
+	spin_unlock_irq(&telemetry->lock);
+
+	kfree(reader);
+	kref_put(&telemetry->kref, kraken_telemetry_release_kref);
+	return 0;
+}
+
+/**
+ * Whether a read would not block.
+ */
+static bool kraken_telemetry_ready(struct kraken_telemetry_reader *reader)
+{
+	struct kraken_telemetry *telemetry = reader->telemetry;
+	bool ready;
+	spin_lock_irq(&telemetry->lock);
+	ready = reader->head != reader->tail || telemetry->disconnected;
+	spin_unlock_irq(&telemetry->lock);
+	return ready;
+}
+
+static bool kraken_telemetry_disconnected(struct kraken_telemetry *telemetry)
+{
+	bool disconnected;
+	spin_lock_irq(&telemetry->lock);
+	disconnected = telemetry->disconnected;
+	spin_unlock_irq(&telemetry->lock);
+	return disconnected;
+}
+
+static bool kraken_telemetry_pop(struct kraken_telemetry_reader *reader,
+                                 struct kraken_telemetry_record *record)
+{
+	struct kraken_telemetry *telemetry = reader->telemetry;
+	bool popped = false;
+	spin_lock_irq(&telemetry->lock);
+	if (reader->head != reader->tail) {
+		*record = reader->records[reader->tail % TELEMETRY_RING_SIZE];
+		reader->tail++;
+		popped = true;
+	}
+	spin_unlock_irq(&telemetry->lock);
+	return popped;
+}
+
+static ssize_t kraken_telemetry_read(struct file *file, char __user *buf,
+                                     size_t count, loff_t *ppos)
+{
+	struct kraken_telemetry_reader *reader = file->private_data;
+	struct kraken_telemetry_record record;
+	size_t read = 0;
+	int ret;
+	if (count < sizeof(record))
+		return -EINVAL;
+
+	for (;;) {
+		// sampled before popping, so that no record pushed before
+		// disconnection is left behind
+		const bool disconnected
+			= kraken_telemetry_disconnected(reader->telemetry);
+		// whole records only
+		while (count - read >= sizeof(record) &&
+		       kraken_telemetry_pop(reader, &record)) {
+			if (copy_to_user(buf + read, &record, sizeof(record)))
+				return read ? read : -EFAULT;
+			read += sizeof(record);
+		}
+		// an empty read is end of file only after disconnection; else
+		// another reader of the file popped the records it was woken for
+		if (read || disconnected)
+			return read;
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		ret = wait_event_interruptible(reader->telemetry->wait,
+		                               kraken_telemetry_ready(reader));
+		if (ret)
+			return ret;
+	}
+}
+
+static __poll_t kraken_telemetry_poll(struct file *file, poll_table *wait)
+{
+	struct kraken_telemetry_reader *reader = file->private_data;
+	struct kraken_telemetry *telemetry = reader->telemetry;
+	__poll_t mask = 0;
+	poll_wait(file, &telemetry->wait, wait);
+
+	spin_lock_irq(&telemetry->lock);
+	if (reader->head != reader->tail)
+		mask |= EPOLLIN | EPOLLRDNORM;
+	if (telemetry->disconnected)
+		mask |= EPOLLHUP;
+	spin_unlock_irq(&telemetry->lock);
+	return mask;
+}
+
+static int kraken_telemetry_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct kraken_telemetry_reader *reader = file->private_data;
+	if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start > PAGE_SIZE)
+		return -EINVAL;
+	// the page is shared by all readers, so must never be written by one
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+	return vm_insert_page(vma, vma->vm_start, reader->telemetry->page);
+}
+
+static const struct file_operations kraken_telemetry_fops = {
+	.owner   = THIS_MODULE,
+	.open    = kraken_telemetry_open,
+	.release = kraken_telemetry_release,
+	.read    = kraken_telemetry_read,
+	.poll    = kraken_telemetry_poll,
+	.mmap    = kraken_telemetry_mmap,
+	.llseek  = no_llseek,
+};
+
+/**
+ * Writes the status page.  Called with the lock held, which serializes
+ * writers.
+ */
+static void
+kraken_telemetry_write_page(struct kraken_telemetry *telemetry,
+                            const struct kraken_telemetry_record *record,
+                            const u8 *msg, size_t len)
+{
+	struct kraken_telemetry_page *page = telemetry->status;
+	const u32 sequence = page->sequence;
+	len = min_t(size_t, len, TELEMETRY_PAGE_RAW_SIZE);
+
+	WRITE_ONCE(page->sequence, sequence + 1);
+	smp_wmb();
+	page->count = record->seq + 1;
+	page->captured_ns = record->captured_ns;
+	page->fan_rpm = record->fan_rpm;
+	page->pump_rpm = record->pump_rpm;
+	page->temp_liquid = record->temp_liquid;
+	page->fan_percent = record->fan_percent;
+	page->pump_percent = record->pump_percent;
+	page->raw_len = len;
+	memcpy(page->raw, msg, len);
+	memset(page->raw + len, 0, TELEMETRY_PAGE_RAW_SIZE - len);
+	smp_wmb();
+	WRITE_ONCE(page->sequence, sequence + 2);
+}
+
+void kraken_telemetry_push(struct usb_kraken *kraken,
+                           const struct kraken_status *status,
+                           const u8 *msg, size_t len)
+{
+	struct kraken_telemetry *telemetry = kraken->telemetry;
+	struct kraken_telemetry_reader *reader;
+	struct kraken_telemetry_record record = {
+		.captured_ns  = ktime_to_ns(status->captured),
+		.fan_rpm      = status->fan_rpm,
+		.pump_rpm     = status->pump_rpm,
+		.temp_liquid  = status->temp_liquid,
+		.fan_percent  = status->fan_percent,
+		.pump_percent = status->pump_percent,
+	};
+	unsigned long flags;
+
+	spin_lock_irqsave(&telemetry->lock, flags);
+	record.seq = telemetry->seq++;
+	kraken_telemetry_write_page(telemetry, &record, msg, len);
+	list_for_each_entry(reader, &telemetry->readers, node) {
+		if (reader->head - reader->tail == TELEMETRY_RING_SIZE) {
+			reader->dropped++;
+			continue;
+		}
+		record.dropped = reader->dropped;
+		reader->records[reader->head % TELEMETRY_RING_SIZE] = record;
+		reader->head++;
+	}
+	spin_unlock_irqrestore(&telemetry->lock, flags);
+	wake_up_interruptible(&telemetry->wait);
+}
+
+int kraken_telemetry_register(struct usb_kraken *kraken)
+{
+	int ret = -ENOMEM;
+	struct kraken_telemetry *telemetry
+		= kzalloc(sizeof(*telemetry), GFP_KERNEL);
+	if (telemetry == NULL)
+		goto error_telemetry;
+	kref_init(&telemetry->kref);
+	spin_lock_init(&telemetry->lock);
+	INIT_LIST_HEAD(&telemetry->readers);
+	init_waitqueue_head(&telemetry->wait);
+
+	telemetry->page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+	if (telemetry->page == NULL)
+		goto error_page;
+	telemetry->status = page_address(telemetry->page);
+
+	ret = ida_alloc(&kraken_telemetry_ids, GFP_KERNEL);
+	if (ret < 0)
+		goto error_id;
+	telemetry->id = ret;
+	snprintf(telemetry->name, sizeof(telemetry->name), "%s-%d",
+	         kraken_driver_name, telemetry->id);
+
+	telemetry->misc.minor = MISC_DYNAMIC_MINOR;
+	telemetry->misc.name = telemetry->name;
+	telemetry->misc.fops = &kraken_telemetry_fops;
+	telemetry->misc.parent = &kraken->interface->dev;
+	telemetry->misc.mode = 0444;
+	// must be set before the device can be opened or status published
+	kraken->telemetry = telemetry;
+	ret = misc_register(&telemetry->misc);
+	if (ret)
+		goto error_misc;
+	return 0;
+error_misc:
+	kraken->telemetry = NULL;
+	ida_free(&kraken_telemetry_ids, telemetry->id);
+error_id:
+	__free_page(telemetry->page);
+error_page:
+	kfree(telemetry);
+error_telemetry:
+	return ret;
+}
+
+void kraken_telemetry_unregister(struct usb_kraken *kraken)
+{
+	struct kraken_telemetry *telemetry = kraken->telemetry;
+	misc_deregister(&telemetry->misc);
+
+	spin_lock_irq(&telemetry->lock);
+	telemetry->disconnected = true;
+	spin_unlock_irq(&telemetry->lock);
+	wake_up_interruptible(&telemetry->wait);
+
+	kraken->telemetry = NULL;
+	kref_put(&telemetry->kref, kraken_telemetry_release_kref);
+}
@@ -0,0 +1,91 @@
+/* Per-device character device streaming timestamped status records, and
+ * sharing the latest status on a page that can be mapped into memory.
+ */
+
+#ifndef LEVIATHAN_TELEMETRY_H_INCLUDED
+#define LEVIATHAN_TELEMETRY_H_INCLUDED
+
+#include "common.h"
+
+#include <linux/types.h>
+
+/**
+ * Each open file of the device buffers up to this many records; records
+ * published while its buffer is full are dropped.  Must be a power of 2.
+ */
+#define TELEMETRY_RING_SIZE 256
+
+/**
+ * A record as read from the device, in host byte order.
+ * @captured_ns: CLOCK_MONOTONIC time the status was received at
+ * @seq: number of statuses the device published before this one
+ * @dropped: number of records the open file has dropped so far
+ * @fan_percent, @pump_percent: duty cycles applied when the status was
+ *                              received, 0 if unknown
+ */
+struct kraken_telemetry_record {
+	__s64 captured_ns;
+	__u32 seq;
+	__u32 dropped;
+	__u16 fan_rpm;
+	__u16 pump_rpm;
+	__u8 temp_liquid;
+	__u8 fan_percent;
+	__u8 pump_percent;
+	__u8 reserved;
+};
+
+/**
+ * Bytes of the raw status message kept on the status page.
+ */
+#define TELEMETRY_PAGE_RAW_SIZE 32
+
+/**
+ * Layout of the status page, which is mapped read-only by mmap() of the device
+ * at offset 0, in host byte order.  The page is written under a sequence
+ * count: a reader reads @sequence, retries while it is odd, copies the fields
+ * and retries if @sequence then differs.  Barriers are needed between these
+ * reads on weakly ordered architectures.
+ * @sequence: odd while the page is being written
+ * @count: number of statuses published, 0 if none yet
+ * @captured_ns: CLOCK_MONOTONIC time the status was received at
+ * @fan_percent, @pump_percent: duty cycles applied when the status was
+ *                              received, 0 if unknown
+ * @raw_len: number of bytes of @raw used
+ * @raw: the message the status was decoded from, as sent by the device
+ */
+struct kraken_telemetry_page {
+	__u32 sequence;
+	__u32 count;
+	__s64 captured_ns;
+	__u16 fan_rpm;
+	__u16 pump_rpm;
+	__u8 temp_liquid;
+	__u8 fan_percent;
+	__u8 pump_percent;
+	__u8 raw_len;
+	__u8 raw[TELEMETRY_PAGE_RAW_SIZE];
+};
+
+/**
+ * Creates the device's misc device, /dev/<driver>-N with N the lowest number
+ * free.
+ */
+int kraken_telemetry_register(struct usb_kraken *kraken);
+
+/**
+ * Removes the misc device.  Files still open read the records left, then end
+ * of file.  Must not be called before the driver has stopped publishing.
+ */
+void kraken_telemetry_unregister(struct usb_kraken *kraken);
+
+/**
+ * Appends a record of the status to each open file, and writes the status and
+ * its raw message to the status page.  Called from kraken_status_publish(), so
+ * safe to call in interrupt context.
+ */
+void kraken_telemetry_push(struct usb_kraken *kraken,
+                           const struct kraken_status *status,
+                           const u8 *msg, size_t len);
+
+#endif  /* LEVIATHAN_TELEMETRY_H_INCLUDED */
@@ -3,6 +3,8 @@
 
 #include "util.h"
 
+#include <linux/ctype.h>
+#include <linux/errno.h>
 #include <linux/kernel.h>
 #include <linux/stringify.h>
 
@@ -23,3 +25,34 @@ int str_scan_word(const char **buf, char *word)
 	// is not empty
 	return ret != 1 || word[0] == '\0';
 }
+
+int str_parse_milli(const char *str, s32 *milli)
+{
+	bool negative = false;
+	bool point = false;
+	unsigned int digits = 0;
+	unsigned int fraction = 0;
+	s64 value = 0;
+	if (*str == '-' || *str == '+')
+		negative = *str++ == '-';
+	for (; *str != '\0'; str++) {
+		if (*str == '.' && !point) {
+			point = true;
+			continue;
+		}
+		if (!isdigit(*str) || (point && ++fraction > 3))
+			return -EINVAL;
+		value = value * 10 + (*str - '0');
+		digits++;
+		if (value > S32_MAX)
+			return -ERANGE;
+	}
+	if (digits == 0)
+		return -EINVAL;
+	for (; fraction < 3; fraction++)
+		value *= 10;
+	if (value > S32_MAX)
+		return -ERANGE;
+	*milli = negative ? -value : value;
+	return 0;
+}
@@ -1,8 +1,16 @@
 #ifndef LEVIATHAN_UTIL_H_INCLUDED
 #define LEVIATHAN_UTIL_H_INCLUDED
 
+#include <linux/types.h>
+
 #define WORD_LEN_MAX 64
 
 int str_scan_word(const char **buf, char *word);
 
+/**
+ * Parses a decimal number of at most 3 fractional digits, e.g. "-1.25", as a
+ * number of thousandths.
+ */
+int str_parse_milli(const char *str, s32 *milli);
+
 #endif  /* LEVIATHAN_UTIL_H_INCLUDED */